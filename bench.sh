@@ -0,0 +1,85 @@
+#!/bin/sh
+# Times ruterdrift on workloads made by gen_workload, so every performance
+# change can be measured the same way. For each topology and size it reports:
+#   load      the load phase of a run of a single 'print'
+#   write     the write phase of the same run
+#   <command> microseconds per command, from the commands phase of a run of
+#             BENCH_COMMANDS commands of that type
+# The phases are read from the statistics written with -m, so no time is
+# found as the difference of two noisy runs. Every time is the best of
+# BENCH_REPEAT runs, each on a fresh copy of the router file.
+#
+# Usage: ./bench.sh [routers ...]      (default: 10000 100000)
+
+RUTERDRIFT=${RUTERDRIFT:-./ruterdrift}
+GEN=${GEN:-./gen_workload}
+TOPOLOGIES=${BENCH_TOPOLOGIES:-chain grid scalefree}
+COMMANDS=${BENCH_COMMANDS:-2000}
+REPEAT=${BENCH_REPEAT:-3}
+DIR=${BENCH_DIR:-bench_data}
+SIZES=${*:-10000 100000}
+
+TYPES="print sett_flag sett_modell legg_til_kobling slett_router finnes_rute"
+
+# Prints the weights for gen_workload -x giving only command type number $1
+weights()
+{
+	case $1 in
+	1) echo 1:0:0:0:0:0 ;;
+	2) echo 0:1:0:0:0:0 ;;
+	3) echo 0:0:1:0:0:0 ;;
+	4) echo 0:0:0:1:0:0 ;;
+	5) echo 0:0:0:0:1:0 ;;
+	6) echo 0:0:0:0:0:1 ;;
+	esac
+}
+
+# Prints the best time in nanoseconds of phase $1 (load, commands or write)
+# of running ruterdrift on router file $2 and commands-file $3
+phase_run()
+{
+	best=
+	i=0
+	while [ $i -lt "$REPEAT" ]; do
+		cp "$2" "$DIR/run.routers"
+		rm -f "$DIR/run.routers.journal" "$DIR/run.json"
+		$RUTERDRIFT -m "$DIR/run.json" "$DIR/run.routers" "$3" > /dev/null 2>&1
+		ns=$(sed -n 's/.*"phases_ns": {[^}]*"'"$1"'": \([0-9]*\).*/\1/p' "$DIR/run.json" 2> /dev/null)
+		if [ -z "$ns" ]; then
+			echo "bench.sh: no statistics from $RUTERDRIFT on $3" >&2
+			exit 1
+		fi
+		if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+			best=$ns
+		fi
+		i=$((i + 1))
+	done
+	echo "$best"
+}
+
+mkdir -p "$DIR" || exit 1
+printf "%-10s %9s %8s %8s" topology routers load_ms write_ms
+for type in $TYPES; do
+	printf " %17s" "${type}_us"
+done
+printf "\n"
+
+for topology in $TOPOLOGIES; do
+	for n in $SIZES; do
+		routers="$DIR/$topology.$n"
+		$GEN -t "$topology" -n "$n" -c 1 -x 1:0:0:0:0:0 "$routers" "$DIR/single.cmd" || exit 1
+		load=$(phase_run load "$routers" "$DIR/single.cmd") || exit 1
+		write=$(phase_run write "$routers" "$DIR/single.cmd") || exit 1
+		printf "%-10s %9s %8s %8s" "$topology" "$n" $((load / 1000000)) $((write / 1000000))
+
+		number=1
+		for type in $TYPES; do
+			$GEN -t "$topology" -n "$n" -c "$COMMANDS" -x "$(weights $number)" "$DIR/gen.routers" "$DIR/$type.cmd" || exit 1
+			ns=$(phase_run commands "$routers" "$DIR/$type.cmd") || exit 1
+			printf " %17s" "$(awk -v ns="$ns" -v n="$COMMANDS" 'BEGIN { printf "%.2f", ns / 1000 / n }')"
+			number=$((number + 1))
+		done
+		printf "\n"
+	done
+done
+rm -f "$DIR/run.routers" "$DIR/run.routers.journal" "$DIR/run.json" "$DIR/gen.routers"
@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE -1
+#define TRUE 1
+#define FALSE 0
+
+#define DESC_MAX_LEN 248
+
+/* Command types, in the order of their weights in option -x */
+#define N_COMMAND_TYPES 6
+
+
+/*
+ * Generates a router file and a matching commands-file for ruterdrift.
+ * The router file has the format read by create_all_routers() and
+ * set_all_connections(): the number of routers (4 bytes), one information
+ * block per router (ID, flag, desc_len, description and a 0), and one
+ * record per connection (fromID, toID and a 0). All numbers are written
+ * in the byte order of the machine, like ruterdrift does.
+ */
+
+/* Shapes of the generated graph */
+enum topology {
+		TOPOLOGY_CHAIN,
+		TOPOLOGY_GRID,
+		TOPOLOGY_SCALEFREE
+};
+
+/* Parameters of a workload, set with the options in main() */
+struct workload {
+		enum topology topology;
+		int n_routers;
+		int degree;                /* Connections added per router (scalefree) */
+		int desc_min;
+		int desc_max;
+		int n_commands;
+		int weights[N_COMMAND_TYPES];
+		uint64_t seed;
+};
+
+/* One connection of the generated graph, as indexes into the router IDs */
+struct edge {
+		int from;
+		int to;
+};
+
+
+/* Generator functions */
+uint64_t next_random();
+int random_below(int n);
+void random_text(char *dest, int len);
+unsigned int *make_router_ids(int n);
+struct edge *make_edges(struct workload *w, size_t *n_edges);
+int write_router_file(char filename[], struct workload *w, unsigned int *ids, struct edge *edges, size_t n_edges);
+int write_commands_file(char filename[], struct workload *w, unsigned int *ids);
+int parse_range(const char *text, int *min, int *max);
+int parse_weights(const char *text, int weights[]);
+
+/* State of the random number generator (xorshift64*) */
+uint64_t random_state = 1;
+
+int main(int argc, char *argv[])
+{
+		struct workload w = {
+				.topology = TOPOLOGY_SCALEFREE,
+				.n_routers = 1000,
+				.degree = 3,
+				.desc_min = 8,
+				.desc_max = 40,
+				.n_commands = 1000,
+				.weights = { 4, 1, 1, 1, 1, 8 },
+				.seed = 1
+		};
+		int opt;
+		while ((opt = getopt(argc, argv, "n:t:m:l:c:x:s:")) != -1) {
+				switch (opt) {
+				case 'n':
+						w.n_routers = atoi(optarg);
+						if (w.n_routers < 2)
+								argc = 0;
+						break;
+				case 't':
+						if (strcmp(optarg, "chain") == 0)
+								w.topology = TOPOLOGY_CHAIN;
+						else if (strcmp(optarg, "grid") == 0)
+								w.topology = TOPOLOGY_GRID;
+						else if (strcmp(optarg, "scalefree") == 0)
+								w.topology = TOPOLOGY_SCALEFREE;
+						else
+								argc = 0;
+						break;
+				case 'm':
+						w.degree = atoi(optarg);
+						if (w.degree < 1)
+								argc = 0;
+						break;
+				case 'l':
+						if (parse_range(optarg, &w.desc_min, &w.desc_max) != SUCCESS)
+								argc = 0;
+						break;
+				case 'c':
+						w.n_commands = atoi(optarg);
+						if (w.n_commands < 0)
+								argc = 0;
+						break;
+				case 'x':
+						if (parse_weights(optarg, w.weights) != SUCCESS)
+								argc = 0;
+						break;
+				case 's':
+						w.seed = strtoull(optarg, NULL, 10);
+						break;
+				default:
+						argc = 0;
+				}
+		}
+		if (argc - optind != 2) {
+				printf("Usage: ./gen_workload [-n routers] [-t chain|grid|scalefree] [-m degree] [-l min:max]\n");
+				printf("                      [-c commands] [-x print:flag:model:connect:remove:path] [-s seed]\n");
+				printf("                      <router_file> <commands_file>\n");
+				return EXIT_FAILURE;
+		}
+		if (w.degree >= w.n_routers)
+				w.degree = w.n_routers - 1;
+		random_state = w.seed * 0x9E3779B97F4A7C15ull + 1;
+
+		size_t n_edges;
+		unsigned int *ids = make_router_ids(w.n_routers);
+		struct edge *edges = ids ? make_edges(&w, &n_edges) : NULL;
+		int result = FAILURE;
+		if (ids && edges && write_router_file(argv[optind], &w, ids, edges, n_edges) == SUCCESS)
+				result = write_commands_file(argv[optind + 1], &w, ids);
+		free(ids);
+		free(edges);
+		return result == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Returns the next number of the generator (xorshift64*) */
+uint64_t next_random()
+{
+		random_state ^= random_state >> 12;
+		random_state ^= random_state << 25;
+		random_state ^= random_state >> 27;
+		return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+
+/* Returns a random number from 0 to <int n> - 1 */
+int random_below(int n)
+{
+		return (int) ((next_random() >> 32) % (uint64_t) n);
+}
+
+
+/* Writes <int len> random printable characters (no newline) to <char *dest> */
+void random_text(char *dest, int len)
+{
+		static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789 -";
+		for (int i = 0; i < len; i++)
+				dest[i] = chars[random_below(sizeof(chars) - 1)];
+}
+
+
+/*
+ * Returns <int n> distinct router IDs in random order. The IDs are spread
+ * over 1 to 3 * n, so they are neither dense nor sorted.
+ */
+unsigned int *make_router_ids(int n)
+{
+		unsigned int *ids = malloc(sizeof(unsigned int) * n);
+		if (!(ids)) {
+				perror("Error with malloc");
+				return NULL;
+		}
+		for (int i = 0; i < n; i++)
+				ids[i] = 3 * (i + 1) - random_below(3);
+		for (int i = n - 1; i > 0; i--) {
+				int j = random_below(i + 1);
+				unsigned int tmp = ids[i];
+				ids[i] = ids[j];
+				ids[j] = tmp;
+		}
+		return ids;
+}
+
+
+/*
+ * Returns the connections of the graph given by <struct workload *w>, and
+ * sets <size_t *n_edges>. A chain connects router i to i + 1, a grid connects
+ * each router to its (up to four) neighbours, and a scale-free graph adds
+ * the routers one by one, each connected to w->degree earlier routers picked
+ * with probability proportional to their degree (Barabási-Albert), in a
+ * random direction. No connection is generated twice.
+ */
+struct edge *make_edges(struct workload *w, size_t *n_edges)
+{
+		int n = w->n_routers;
+		size_t capacity = w->topology == TOPOLOGY_CHAIN ? (size_t) n
+				: w->topology == TOPOLOGY_GRID ? (size_t) n * 4 : (size_t) n * w->degree + w->degree;
+		struct edge *edges = malloc(sizeof(struct edge) * capacity);
+		if (!(edges)) {
+				perror("Error with malloc");
+				return NULL;
+		}
+		size_t count = 0;
+
+		if (w->topology == TOPOLOGY_CHAIN) {
+				for (int i = 0; i + 1 < n; i++)
+						edges[count++] = (struct edge) { i, i + 1 };
+		} else if (w->topology == TOPOLOGY_GRID) {
+				int width = 1;
+				while (width * width < n)
+						width++;
+				for (int i = 0; i < n; i++) {
+						if ((i + 1) % width != 0 && i + 1 < n)
+								edges[count++] = (struct edge) { i, i + 1 };
+						if (i % width != 0)
+								edges[count++] = (struct edge) { i, i - 1 };
+						if (i + width < n)
+								edges[count++] = (struct edge) { i, i + width };
+						if (i - width >= 0)
+								edges[count++] = (struct edge) { i, i - width };
+				}
+		} else {
+				/* Every endpoint of every connection, so a uniform pick is by degree */
+				int *ends = malloc(sizeof(int) * 2 * capacity);
+				int *picked = malloc(sizeof(int) * w->degree);
+				if (!(ends) || !(picked)) {
+						perror("Error with malloc");
+						free(ends);
+						free(picked);
+						free(edges);
+						return NULL;
+				}
+				size_t n_ends = 0;
+				int m = w->degree;
+				/* The first m + 1 routers form a ring */
+				for (int i = 0; i <= m && i < n; i++) {
+						edges[count++] = (struct edge) { i, (i + 1) % (m + 1) };
+						ends[n_ends++] = i;
+						ends[n_ends++] = (i + 1) % (m + 1);
+				}
+				for (int i = m + 1; i < n; i++) {
+						int n_picked = 0;
+						while (n_picked < m) {
+								int target = ends[next_random() % n_ends];
+								int seen = FALSE;
+								for (int k = 0; k < n_picked; k++)
+										seen |= picked[k] == target;
+								if (!(seen))
+										picked[n_picked++] = target;
+						}
+						for (int k = 0; k < m; k++) {
+								if (next_random() & 1)
+										edges[count++] = (struct edge) { i, picked[k] };
+								else
+										edges[count++] = (struct edge) { picked[k], i };
+								ends[n_ends++] = i;
+								ends[n_ends++] = picked[k];
+						}
+				}
+				free(ends);
+				free(picked);
+		}
+		*n_edges = count;
+		return edges;
+}
+
+
+/*
+ * Writes the routers <unsigned int *ids> with random flags and descriptions,
+ * and the connections <struct edge *edges>, to the router file <char filename[]>.
+ * Returns SUCCESS, or FAILURE (after printing an error).
+ */
+int write_router_file(char filename[], struct workload *w, unsigned int *ids, struct edge *edges, size_t n_edges)
+{
+		FILE *fh = fopen(filename, "wb");
+		if (!(fh)) {
+				fprintf(stderr, "Error when trying to open file called '%s': ", filename);
+				perror("");
+				return FAILURE;
+		}
+		unsigned char block[6 + DESC_MAX_LEN + 1];
+		fwrite(&w->n_routers, sizeof(int), 1, fh);
+		for (int i = 0; i < w->n_routers; i++) {
+				int len = w->desc_min + random_below(w->desc_max - w->desc_min + 1);
+				memcpy(block, &ids[i], sizeof(unsigned int));
+				block[4] = random_below(256);
+				block[5] = len;
+				random_text((char *) block + 6, len);
+				block[6 + len] = 0;
+				fwrite(block, 1, 6 + len + 1, fh);
+		}
+		for (size_t i = 0; i < n_edges; i++) {
+				memcpy(block, &ids[edges[i].from], sizeof(unsigned int));
+				memcpy(block + 4, &ids[edges[i].to], sizeof(unsigned int));
+				block[8] = 0;
+				fwrite(block, 1, 9, fh);
+		}
+		if (ferror(fh) | fclose(fh)) {
+				fprintf(stderr, "Error when writing '%s'\n", filename);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+/*
+ * Writes w->n_commands commands to the commands-file <char filename[]>,
+ * each type picked with the probability given by its weight. Commands only
+ * name routers that still exist: removed routers are dropped from the pool,
+ * and the last two routers are never removed.
+ * Returns SUCCESS, or FAILURE (after printing an error).
+ */
+int write_commands_file(char filename[], struct workload *w, unsigned int *ids)
+{
+		FILE *fh = fopen(filename, "w");
+		if (!(fh)) {
+				fprintf(stderr, "Error when trying to open file called '%s': ", filename);
+				perror("");
+				return FAILURE;
+		}
+		int total = 0;
+		for (int t = 0; t < N_COMMAND_TYPES; t++)
+				total += w->weights[t];
+
+		/* ids is reused as the pool of routers still alive, ids[0..alive - 1] */
+		int alive = w->n_routers;
+		char name[DESC_MAX_LEN + 1];
+		for (int i = 0; i < w->n_commands; i++) {
+				int pick = random_below(total);
+				int type = 0;
+				while (pick >= w->weights[type])
+						pick -= w->weights[type++];
+				unsigned int a = ids[random_below(alive)];
+				unsigned int b = ids[random_below(alive)];
+				int bit_pos;
+				int slot;
+				int len;
+				switch (type) {
+				case 0:
+						fprintf(fh, "print %u\n", a);
+						break;
+				case 1:
+						bit_pos = (int[]) { 0, 1, 2, 4 }[random_below(4)];
+						fprintf(fh, "sett_flag %u %d %d\n", a, bit_pos, random_below(bit_pos == 4 ? 16 : 2));
+						break;
+				case 2:
+						len = w->desc_min + random_below(w->desc_max - w->desc_min + 1);
+						if (len == 0)
+								len = 1;
+						random_text(name, len);
+						fprintf(fh, "sett_modell %u %.*s\n", a, len, name);
+						break;
+				case 3:
+						fprintf(fh, "legg_til_kobling %u %u\n", a, b);
+						break;
+				case 4:
+						if (alive <= 2) {
+								fprintf(fh, "print %u\n", a);
+								break;
+						}
+						slot = random_below(alive);
+						fprintf(fh, "slett_router %u\n", ids[slot]);
+						ids[slot] = ids[--alive];
+						break;
+				case 5:
+						fprintf(fh, "finnes_rute %u %u\n", a, b);
+						break;
+				}
+		}
+		if (fclose(fh) != 0) {
+				fprintf(stderr, "Error when writing '%s'\n", filename);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+/*
+ * Reads "min:max" (or a single number) from <const char *text> into
+ * <int *min> and <int *max>. Returns FAILURE if out of 0 to DESC_MAX_LEN.
+ */
+int parse_range(const char *text, int *min, int *max)
+{
+		char *end;
+		*min = strtol(text, &end, 10);
+		*max = *end == ':' ? strtol(end + 1, NULL, 10) : *min;
+		if (*min < 0 || *max < *min || *max > DESC_MAX_LEN)
+				return FAILURE;
+		return SUCCESS;
+}
+
+
+/*
+ * Reads N_COMMAND_TYPES weights separated by ':' from <const char *text>
+ * into <int weights[]>. Returns FAILURE unless all are given, none is
+ * negative and at least one is positive.
+ */
+int parse_weights(const char *text, int weights[])
+{
+		int total = 0;
+		for (int t = 0; t < N_COMMAND_TYPES; t++) {
+				char *end;
+				weights[t] = strtol(text, &end, 10);
+				if (end == text || weights[t] < 0 || (t + 1 < N_COMMAND_TYPES && *end != ':'))
+						return FAILURE;
+				total += weights[t];
+				text = end + 1;
+		}
+		return total > 0 ? SUCCESS : FAILURE;
+}
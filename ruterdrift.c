@@ -3,6 +3,24 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <signal.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define SUCCESS 0
 #define FAILURE -1
@@ -16,113 +34,1123 @@
 #define CLR_NRM "\x1B[0m"
 
 #define BLOCK_MAX_SIZE 256
+#define HEADER_SIZE 6
 #define DESC_MAX_LEN 248
-#define MAX_CONNECTIONS 10
 
+/* Room of a connection row when it first moves to the end of the adjacency */
+#define ADJ_MIN_ROOM 4
 
+/* Unused entries in the adjacency tolerated before it is compacted */
+#define ADJ_COMPACT_MIN_HOLES 4096
+
+/* Size of the buffer the router file is serialized into before each write() */
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+/* Length of a connection record in the router file: fromID, toID and a 0 */
+#define CONNECTION_RECORD_SIZE 9
+
+/* Connection records decoded per chunk by the worker pool at load */
+#define LOAD_CHUNK_RECORDS 65536
+
+/* First bytes of a compiled (binary) commands-file, see enum binary_op */
+#define BINARY_MAGIC "RDC1"
+
+/* Journal of changes kept next to the router file (option -j) */
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC "RDJ1"
+#define JOURNAL_HEADER_SIZE 28
+
+/* Graphs with more routers than this use bidirectional search in SEARCH_AUTO */
+#define BIDIR_MIN_ROUTERS 4096
+
+/* Number of sources kept in the reachability cache */
+#define REACH_CACHE_ENTRIES 8
+
+/* Largest number of components for which exact reachability bitsets are built */
+#define SCC_BITSET_MAX_COMPONENTS 8192
+
+/* Answer from the SCC index when it can not decide reachability on its own */
+#define SCC_UNKNOWN 2
+
+/* Number of sources searched from at once in a batch (bits in a uint64_t) */
+#define BATCH_SOURCES 64
+
+/* Fewest path queries in a batch for a reachability sweep to pay off */
+#define BATCH_MIN_QUERIES 64
+
+/* Most groups of sources answered one by one after a sweep did not pay off */
+#define BATCH_MAX_BACKOFF 256
+
+/* Number of router structs allocated at once by the router arena */
+#define ARENA_CHUNK_ROUTERS 4096
+
+/* Empty slot marker in the router index, and hash multiplier (golden ratio) */
+#define INDEX_EMPTY -1
+#define INDEX_HASH_MUL 2654435761u
+
+/* Connections of a router above which is_connected() looks them up in the
+ * neighbour set instead of scanning the row, and the hash multiplier of the
+ * set (golden ratio, 64 bits) */
+#define NEIGHBOUR_SET_MIN_DEGREE 16
+#define NEIGHBOUR_HASH_MUL 11400714819323198485ull
+#define NEIGHBOUR_EMPTY UINT64_MAX
+
+/* Returned by answer_path() when the query needs a search_path() */
+#define SEARCH_NEEDED -1
+
+/* Largest worker pool (option -t), and smallest read run worth splitting */
+#define MAX_THREADS 64
+#define PARALLEL_MIN_JOBS 64
+
+/* Read-only commands, and IDs of answered paths, kept before a read run is executed */
+#define READ_RUN_MAX_JOBS 65536
+#define READ_RUN_MAX_PATH_IDS (1 << 22)
+
+/* Read size of a commands stream, and commands run before its output is flushed */
+#define STREAM_BUFFER_SIZE 65536
+#define STREAM_FLUSH_COMMANDS 4096
+
+/* Histogram buckets: values below 8 exactly, then 8 buckets per power of two */
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/* Clients served at once in daemon mode, and the line ending each reply */
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_REPLY_END "."
+
+/* Router slots per page of a snapshot, the unit copied when routers change,
+ * and what changed on a page: the routers or only their descriptions */
+#define SNAPSHOT_PAGE_SLOTS 256
+#define SNAPSHOT_GRAPH 1
+#define SNAPSHOT_DESC 2
+
+/* Connections per router allowed by the original file specification, checked by option -V */
+#define SPEC_MAX_CONNECTIONS 10
+
+/* Bytes of output formatted before each write, enough for a whole 'print' */
+#define OUTPUT_CHUNK_SIZE 4096
+
+
+/*
+ * Topology of a router: what searches and connection changes touch.
+ * Fields are ordered by alignment, so the struct has no packing and
+ * all pointers are aligned. The description is kept in desc_store.
+ * The connections of the router are the slots
+ * adjacency.target[conn_start] to adjacency.target[conn_start + n_conn - 1].
+ */
 struct router {
+		union {
+				/* Reverse adjacency: routers with a connection to this router */
+				struct router **incoming;
+				/* Next released router in the free list of the arena */
+				struct router *next_free;
+		};
+		size_t conn_start;
 		unsigned int routerID;
+		int n_conn;
+		int conn_room;
+		int n_incoming;
+		int incoming_cap;
+		/* Slot of this router in router_array, used as dense index in searches */
+		int slot;
 		unsigned char flag;
+		/* TRUE if the connections of this router are in adjacency.neighbours */
+		unsigned char hashed;
+};
+
+/*
+ * Producer/model of a router, stored apart from the topology in
+ * desc_store at the slot of the router. Only printing, 'sett_modell'
+ * and writing to file use it.
+ */
+struct router_desc {
 		unsigned char desc_len;
 		char description[DESC_MAX_LEN];
-		struct router *connections[MAX_CONNECTIONS];
-}__attribute__((__packed__));
+};
+
 
+/*
+ * Block of ARENA_CHUNK_ROUTERS router structs owned by the router arena.
+ * Chunks are linked, and routers are handed out from the start of the
+ * newest chunk (used counts those handed out).
+ */
+struct router_chunk {
+		struct router_chunk *next;
+		int used;
+		struct router routers[];
+};
+
+/*
+ * Slab allocator owning all router structs. Released routers are kept
+ * in a free list, linked through their next_free, for reuse.
+ */
+struct router_arena {
+		struct router_chunk *chunks;
+		struct router *free_list;
+		int n_chunks;
+};
+
+
+/*
+ * Open addressing hash table (linear probing) mapping a routerID to the
+ * slot of the router in the global router_array. Capacity is always a
+ * power of two, and at least twice the number of routers in the file.
+ */
+struct router_index {
+		unsigned int *keys;
+		int *slots;
+		unsigned int capacity;
+		unsigned int count;
+		unsigned int shift;
+};
+
+/*
+ * Set of connections (from slot << 32 | to slot) of the routers with more
+ * than NEIGHBOUR_SET_MIN_DEGREE connections, so is_connected() need not scan
+ * their rows. A row is added the first time it is looked up, and kept up
+ * to date from then on. Open addressing like the router index, with
+ * NEIGHBOUR_EMPTY for a free bucket.
+ */
+struct neighbour_set {
+		uint64_t *keys;
+		unsigned int capacity;
+		unsigned int count;
+		unsigned int shift;
+};
+
+/*
+ * Connections of all routers, in compressed sparse row form: the row of a
+ * router is n_conn slots starting at its conn_start, with room for conn_room.
+ * At load the rows are built back to back from the collected connections
+ * (load_from/load_to). A row without room for a new connection is moved to
+ * the end of target with twice the room, and its old entries become holes;
+ * adjacency_compact() packs the rows again once holes outnumber connections.
+ */
+struct adjacency {
+		int *target;
+		size_t used;
+		size_t capacity;
+		size_t live;
+		int *load_from;
+		int *load_to;
+		size_t n_load;
+		size_t load_cap;
+		struct neighbour_set neighbours;
+};
+
+/*
+ * Connection section of a mapped router file, decoded in chunks of
+ * LOAD_CHUNK_RECORDS by the worker pool. Record i is decoded into slots
+ * adjacency.load_from[i] and load_to[i], INDEX_EMPTY for an unknown router,
+ * and n_unknown[c] counts the records of chunk c with an unknown router.
+ * <pass>, <out_degree> and <in_degree> are used by adjacency_build() to
+ * share out the collected connections in <n_parts> equal parts; the degree
+ * arrays hold one row of N counts per part.
+ */
+struct connection_load {
+		const unsigned char *records;
+		size_t n_records;
+		int n_chunks;
+		int *n_unknown;
+		atomic_int next_chunk;
+		int pass;
+		int n_parts;
+		int *out_degree;
+		int *in_degree;
+};
+
+/*
+ * Buffer the router file is serialized into. Full buffers are written to
+ * <fd> with write(); <failed> is set if a write fails, and later output
+ * is then dropped.
+ */
+struct write_buffer {
+		unsigned char *data;
+		size_t len;
+		int fd;
+		int failed;
+};
+
+/*
+ * Changes recorded by the journal, one opcode byte per record. Operands
+ * are routerIDs (4 bytes) and, for JOURNAL_FLAG, the new flag (1 byte),
+ * and for JOURNAL_MODEL, desc_len (1 byte) followed by the description.
+ */
+enum journal_op {
+		JOURNAL_FLAG = 'F',
+		JOURNAL_MODEL = 'M',
+		JOURNAL_CONNECTION = 'C',
+		JOURNAL_REMOVE = 'D'
+};
+
+/*
+ * Append-only log of changes made by commands, replayed on top of the
+ * router file at load. The header holds JOURNAL_MAGIC and the size and
+ * modification time of the router file the journal belongs to, so a
+ * journal left behind by a router file which has since been rewritten
+ * is never replayed. <valid_len> is the length of the journal up to the
+ * last complete record.
+ */
+struct journal {
+		struct write_buffer buf;
+		char *name;
+		uint64_t base_size;
+		uint64_t base_sec;
+		uint64_t base_nsec;
+		size_t valid_len;
+		int valid;
+		int enabled;
+};
 
 /* File functions */
 FILE *open_file(char filename[], char mode[]);
+int load_router_file(FILE *fh);
+int load_router_file_mmap(FILE *fh, size_t size);
+int load_router_file_stdio(FILE *fh);
+int allocate_router_array(int num_routers);
 void get_to_next_router_info_block(FILE *fh);
 int get_num_from_stream(unsigned int* number, FILE *fh);
-int write_to_file(FILE *fh);
-int write_connections_to_file(FILE *fh);
+int save_router_file(char filename[]);
+int sync_directory(char filename[]);
+int write_to_file(int fd);
+int write_connections_to_file(struct write_buffer *b);
+unsigned char *wbuf_reserve(struct write_buffer *b, size_t n);
+int wbuf_flush(struct write_buffer *b);
+
+/* Journal functions */
+int journal_replay(char filename[], FILE *router_file);
+int journal_apply(const unsigned char *buf, size_t size, size_t *pos);
+int journal_open();
+int journal_close();
+int journal_sync();
+void journal_discard();
+void journal_write_header();
+void journal_record_flag(struct router *r);
+void journal_record_model(struct router *r);
+void journal_record_connection(unsigned int fromID, unsigned int toID);
+void journal_record_remove(unsigned int routerID);
+void journal_free();
 
 /* Router/routing config functions */
-struct router *create_router(FILE *fh);
+struct router *new_router();
+struct router *create_router(FILE *fh, int slot);
+struct router *create_router_from_buffer(const unsigned char *buf, size_t size, size_t *pos, int slot);
+void read_router_header(struct router *r, const unsigned char header[]);
+void write_router_header(unsigned char header[], struct router *r);
 int create_all_routers(struct router **dest, FILE *fh, int N);
 struct router *get_router(unsigned int routerID);
+struct router *find_router(unsigned int routerID);
 int is_connected(struct router *r, unsigned int id);
 int add_connection(unsigned int fromID, unsigned int toID);
 int set_connection(struct router *from, struct router *to);
+int add_incoming(struct router *to, struct router *from);
+void remove_incoming(struct router *to, struct router *from);
 int set_all_connections(FILE *fh);
+int set_all_connections_from_buffer(const unsigned char *buf, size_t size, size_t pos);
+int load_connection(struct router *from, struct router *to);
 unsigned char bit_pos_on(unsigned char flag, unsigned char bit_pos);
 unsigned char bit_pos_off(unsigned char flag, unsigned char bit_pos);
 unsigned char change_top_four_bits(unsigned char flag, unsigned char val);
 int set_flag(unsigned int routerID, unsigned char bit_pos, unsigned char val);
-int set_model(unsigned int routerID, char *new_name);
+int set_model(unsigned int routerID, const char *new_name, int len);
 int remove_router(unsigned int routerID);
 void remove_all_routers();
 
+/* Commands of the commands-file, told apart by command_keyword() */
+enum command_kind {
+		CMD_INVALID,
+		CMD_PRINT,
+		CMD_SETT_FLAG,
+		CMD_SETT_MODELL,
+		CMD_LEGG_TIL_KOBLING,
+		CMD_SLETT_ROUTER,
+		CMD_FINNES_RUTE,
+		CMD_SCC_INDEKS
+};
+#define N_COMMAND_KINDS (CMD_SCC_INDEKS + 1)
+
+/*
+ * Opcodes of the compiled commands-file made with option -B. The file starts
+ * with BINARY_MAGIC, followed by one record per command: the opcode byte and
+ * its operands, with routerIDs as 4 byte little-endian numbers.
+ * BIN_SETT_FLAG has two more bytes (bit_pos, value), and BIN_SETT_MODELL and
+ * BIN_SCC_INDEKS end with a length byte followed by the string.
+ */
+enum binary_op {
+		BIN_PRINT = 'P',
+		BIN_SETT_FLAG = 'F',
+		BIN_SETT_MODELL = 'M',
+		BIN_LEGG_TIL_KOBLING = 'C',
+		BIN_SLETT_ROUTER = 'D',
+		BIN_FINNES_RUTE = 'R',
+		BIN_SCC_INDEKS = 'S'
+};
+
+/*
+ * One parsed command line. <args> holds the <n_args> numbers found after
+ * the keyword. <text> is the description of 'sett_modell' or the argument
+ * of 'scc_indeks' (NULL if missing). Keyword and text point into the line
+ * and are not 0-terminated.
+ */
+struct command {
+		enum command_kind kind;
+		const char *keyword;
+		int keyword_len;
+		unsigned int args[3];
+		int n_args;
+		const char *text;
+		int text_len;
+};
+
+/*
+ * Reusable working memory for path searches, indexed by router slot.
+ * A slot counts as visited when its stamp equals the current epoch,
+ * so starting a new search is O(1) instead of clearing the arrays.
+ * The *_back arrays hold the backward half of a bidirectional search.
+ */
+struct search_scratch {
+		unsigned int *stamp;
+		int *parent;
+		int *queue;
+		int *dist;
+		unsigned int *stamp_back;
+		int *parent_back;
+		int *queue_back;
+		int *dist_back;
+		unsigned int *path;
+		int capacity;
+		unsigned int epoch;
+		int visited;        /* Routers expanded by the last search */
+		struct snapshot *snapshot;  /* Graph searched, the live graph if NULL */
+};
+
+/*
+ * Breadth first search tree from one source router, built on the
+ * graph as it was at <epoch>. Bit i of reachable is set if the router
+ * in slot i can be reached, and parent[i] is then its parent in the tree.
+ */
+struct reach_entry {
+		int source;
+		unsigned long epoch;
+		unsigned long last_used;
+		uint64_t *reachable;
+		int *parent;
+		int capacity;
+};
+
+/*
+ * Cache of search trees keyed by source. A source gets a tree once it has
+ * been searched from twice in the same graph epoch (the candidates).
+ */
+struct reach_cache {
+		struct reach_entry entries[REACH_CACHE_ENTRIES];
+		int candidates[REACH_CACHE_ENTRIES];
+		int next_candidate;
+		unsigned long candidate_epoch;
+		unsigned long clock;
+		int enabled;
+};
+
+/*
+ * Strongly connected components of the graph, built with Tarjan's algorithm.
+ * Components are numbered in the order Tarjan completes them, which is a
+ * reverse topological order of the condensation DAG: a connection between two
+ * components always goes from a higher to a lower number.
+ * low[c] is the lowest component number reachable from c, so [low[c], c] is
+ * an interval label containing every component reachable from c.
+ * If there are few enough components, reach holds an exact bitset of
+ * reachable components per component (words uint64_t per component).
+ * members lists the slots of component c from members[first[c]] to
+ * members[first[c + 1] - 1].
+ */
+struct scc_index {
+		int *component;
+		int *members;
+		int *first;
+		int *low;
+		unsigned char *cyclic;
+		uint64_t *reach;
+		int words;
+		int n_components;
+		int largest;
+		unsigned long epoch;
+		int built;
+		int enabled;
+};
+
+/*
+ * Consecutive 'finnes_rute' and 'print' commands collected by
+ * run_all_commands(), answered together by run_path_batch().
+ * Entry i is a 'print' of from[i] if is_print[i] is TRUE.
+ * bits, pending and want are one word per router slot for batch_sweep().
+ */
+struct path_batch {
+		unsigned int *from;
+		unsigned int *to;
+		unsigned char *is_print;
+		int count;
+		int n_queries;
+		int capacity;
+		uint64_t *bits;
+		uint64_t *pending;
+		uint64_t *want;
+		int n_slots;
+		int skip_groups;    /* Groups to answer one by one before the next sweep */
+		int backoff;        /* Groups skipped after the last sweep that gave up */
+};
+
+/* Kinds of read-only commands in a read run */
+enum read_job_kind {
+		JOB_PRINT,
+		JOB_INVALID,
+		JOB_RESULT,
+		JOB_SEARCH
+};
+
+/*
+ * A read-only command in a read run. JOB_PRINT prints router fromID,
+ * JOB_INVALID warns about nonexistent router fromID. JOB_RESULT is a path
+ * query already answered, with path_len IDs at path_start in the run's
+ * paths, and JOB_SEARCH one that still needs search_path().
+ * The output of the job is out_len bytes at out_start in the output
+ * of the worker that ran it.
+ */
+struct read_job {
+		enum read_job_kind kind;
+		enum command_kind command;
+		unsigned int fromID;
+		unsigned int toID;
+		int from_slot;
+		int to_slot;
+		int path_len;
+		size_t path_start;
+		int worker;
+		long out_start;
+		long out_len;
+		uint64_t plan_ns;   /* Time spent on the job, with option -m */
+		uint64_t run_ns;
+		int visited;
+};
+
+/*
+ * Read-only commands ('print' and 'finnes_rute') found between two commands
+ * that change the graph. Everything that depends on the order of commands
+ * (the SCC index and the reachability cache) is done as the run is collected;
+ * the searches and printing are left to read_run_flush(), which may split
+ * them over the worker pool.
+ */
+struct read_run {
+		struct read_job *jobs;
+		int count;
+		int capacity;
+		unsigned int *paths;
+		size_t n_paths;
+		size_t paths_cap;
+		atomic_int next_job;
+		long n_queries;             /* Path queries run so far, for batch_budget() */
+		long n_misses;              /* Of those, queries without a path */
+		long n_searched_misses;     /* Of those, queries answered by a search */
+		uint64_t miss_visited;      /* Routers expanded by those searches */
+};
+
+/* A thread of the worker pool, with its own search scratch and output */
+struct worker {
+		struct search_scratch scratch;
+		FILE *out;
+		char *out_buf;
+		size_t out_size;
+		int id;
+		pthread_t thread;
+};
+
+/*
+ * Threads running read runs and decoding the router file, started the first
+ * time there is enough work. Worker 0 is the main thread. Work is handed out
+ * by setting task and incrementing generation, and is finished when n_busy
+ * drops back to 0.
+ */
+struct worker_pool {
+		struct worker *workers;
+		void (*task)(struct worker *w);
+		int n_threads;
+		int started;
+		unsigned long generation;
+		int n_busy;
+		int shutdown;
+		pthread_mutex_t lock;
+		pthread_cond_t work_ready;
+		pthread_cond_t work_done;
+};
+
+/*
+ * Log-linear histogram of values (HDR style): values below
+ * 2^STATS_SUB_BITS have a bucket each, larger ones share a bucket with
+ * values having the same STATS_SUB_BITS bits after the leading one.
+ */
+struct histogram {
+		uint64_t count;
+		uint64_t sum;
+		uint64_t min;
+		uint64_t max;
+		uint64_t buckets[STATS_BUCKETS];
+};
+
+/* Phases of a run timed with option -m */
+enum stats_phase {
+		PHASE_LOAD,
+		PHASE_COMMANDS,
+		PHASE_PATH_BATCHES,
+		PHASE_WRITE,
+		N_PHASES
+};
+
+/*
+ * Counters and latencies (in nanoseconds) of every command type, and the
+ * routers expanded and path length of each 'finnes_rute', written as JSON
+ * to <file> at exit with option -m. Work shared by a batch of path queries
+ * (SCC index and reachability sweeps) counts in PHASE_PATH_BATCHES, not
+ * in the latency of the queries.
+ */
+struct stats {
+		char *file;
+		int enabled;
+		uint64_t failures[N_COMMAND_KINDS];
+		struct histogram latency[N_COMMAND_KINDS];
+		struct histogram visited;
+		struct histogram path_length;
+		uint64_t phase_ns[N_PHASES];
+};
+
+/*
+ * Daemon mode (option -d). Commands that only read the graph run on a
+ * snapshot, all others hold <lock> and change the live graph. clients holds
+ * the socket of each connected client, or -1 for a free slot. <log> is a
+ * copy of stderr for the daemon's own errors and warnings, since stderr is
+ * pointed at a client while it runs a command that changes the graph.
+ */
+struct server {
+		char *router_name;
+		int listen_fd;
+		int clients[SERVER_MAX_CLIENTS];
+		int n_clients;
+		atomic_int stopping;
+		FILE *log;
+		pthread_mutex_t lock;
+		pthread_mutex_t clients_lock;
+		pthread_cond_t clients_done;
+};
+
+/*
+ * Descriptions of the routers of one snapshot page. Shared by all versions
+ * of the page until 'sett_modell' changes one of them; <refs> counts the pages.
+ */
+struct snapshot_desc {
+		atomic_int refs;
+		struct router_desc desc[SNAPSHOT_PAGE_SLOTS];
+};
+
+/*
+ * The routers in the SNAPSHOT_PAGE_SLOTS slots of page p, from slot
+ * p * SNAPSHOT_PAGE_SLOTS, as they were when the page was made. A page never
+ * changes, and is shared by all snapshots made until one of its routers
+ * changes; <refs> counts them. The connections (slots) of the router in
+ * slot i of the page are conn[conn_start[i]]
+ * to conn[conn_start[i + 1] - 1], and its incoming connections likewise
+ * from in_start[i]. present[i] is FALSE for an empty slot.
+ */
+struct snapshot_page {
+		atomic_int refs;
+		unsigned char present[SNAPSHOT_PAGE_SLOTS];
+		unsigned char flag[SNAPSHOT_PAGE_SLOTS];
+		unsigned int routerID[SNAPSHOT_PAGE_SLOTS];
+		int conn_start[SNAPSHOT_PAGE_SLOTS + 1];
+		int in_start[SNAPSHOT_PAGE_SLOTS + 1];
+		int *conn;
+		struct snapshot_desc *desc;
+};
+
+/*
+ * One version of the graph: a page per SNAPSHOT_PAGE_SLOTS router slots.
+ * Readers pin it with snapshot_acquire(), and it is freed when the last of
+ * them and the publisher have let go of it (<refs>).
+ */
+struct snapshot {
+		atomic_int refs;
+		int n_routers;
+		int n_pages;
+		struct snapshot_page *pages[];
+};
+
+/*
+ * Copy-on-write snapshots of the graph, made in daemon mode so that reads
+ * never wait for changes. The writer marks the pages of changed routers in
+ * <dirty> (SNAPSHOT_GRAPH, SNAPSHOT_DESC), and snapshot_publish() makes a
+ * new version sharing all other pages with the current one. <lock> guards
+ * only the swap of <current> and the pinning of it. Routers are never added
+ * after load, so <index> is a copy of the router index made at start.
+ */
+struct snapshots {
+		int enabled;
+		struct snapshot *current;
+		pthread_mutex_t lock;
+		unsigned char *dirty;
+		int any_dirty;
+		struct router_index index;
+};
+
+/* Where the report on one chunk of connection records is, in the output of <worker> */
+struct validate_chunk {
+		int worker;
+		long out_start;
+		long out_len;
+};
+
+/*
+ * Router file being checked with option -V, mapped at <buf>. The header
+ * gives <n_declared> routers, of which <n_routers> have distinct IDs and
+ * <n_duplicates> repeat one. block[s] is the
+ * byte offset of the information block of the router in slot s (the first
+ * router with its ID). Connection record i is at records_start + 9 * i, and
+ * its from-router is in slot from_slot[i], INDEX_EMPTY if unknown.
+ * Pass 1 checks chunks of LOAD_CHUNK_RECORDS records; passes 2 and 3 count
+ * and list the records of each router, each of <n_parts> workers taking an
+ * equal part of the records like build_rows(), with its own row of counts
+ * in row_count. Pass 4 checks the connections of each router, the workers
+ * sharing out the slots. The records of the router in slot s are listed in
+ * row[row_start[s]] to row[row_start[s + 1] - 1].
+ */
+struct validation {
+		const unsigned char *buf;
+		size_t size;
+		size_t *block;
+		int n_declared;
+		int n_routers;
+		int n_duplicates;
+		size_t records_start;
+		size_t n_records;
+		int *from_slot;
+		size_t *row_start;
+		unsigned int *row_count;
+		unsigned int *row;
+		int n_chunks;
+		struct validate_chunk *chunks;
+		atomic_int next_chunk;
+		int pass;
+		int parallel;
+		int n_parts;
+		atomic_long n_problems;
+};
+
+/* Search engine used by exists_path() */
+enum search_mode {
+		SEARCH_AUTO,
+		SEARCH_FORWARD,
+		SEARCH_BIDIRECTIONAL
+};
+
+/* Format of the output of commands, selected with option -o */
+enum output_mode {
+		OUTPUT_TEXT,
+		OUTPUT_JSON
+};
+
+/* Data of one router as printed by 'print', from the live graph or a snapshot */
+struct router_view {
+		unsigned int routerID;
+		unsigned char flag;
+		const struct router_desc *desc;
+		const int *conn;
+		int n_conn;
+};
+
+/*
+ * Output of one command, formatted into <data> and written to <out> in one
+ * fwrite() when done, or whenever <data> is full.
+ */
+struct out_chunk {
+		FILE *out;
+		size_t len;
+		char data[OUTPUT_CHUNK_SIZE];
+};
+
+
+/* Router arena functions */
+struct router *arena_alloc();
+void arena_release(struct router *r);
+void arena_free_all();
+
+/* Adjacency functions */
+int adjacency_build();
+int adjacency_reserve(size_t capacity);
+int adjacency_append(struct router *from, int to_slot);
+void adjacency_remove(struct router *from, int to_slot);
+void adjacency_drop_row(struct router *r);
+int adjacency_compact();
+void adjacency_free();
+int row_contains(const int *conn, int n, int slot);
+
+/* Neighbour set functions */
+uint64_t neighbour_key(int from_slot, int to_slot);
+unsigned int neighbour_hash(uint64_t key);
+int neighbour_reserve(unsigned int count);
+void neighbour_insert(uint64_t key);
+int neighbour_contains(uint64_t key);
+void neighbour_remove(uint64_t key);
+int neighbour_add_row(struct router *r);
+void neighbour_drop_row(struct router *r);
+
+/* Router index functions */
+int index_init(unsigned int num_routers);
+unsigned int index_hash(unsigned int routerID);
+int index_insert(unsigned int routerID, int slot);
+int index_lookup(unsigned int routerID);
+void index_remove(unsigned int routerID);
+void index_free();
+
 /* Command interaction functions */
-int run_command(char line[]);
+enum command_kind command_keyword(const char *word, int len);
+const char *parse_number(const char *p, const char *end, unsigned int *number);
+void parse_command(const char *line, size_t len, struct command *cmd);
+int execute_command(struct command *cmd);
+int run_command(const char *line, size_t len);
+char *map_command_file(FILE *fh, size_t *size, int *mapped);
 int run_all_commands(FILE *fh);
+int run_command_buffer(const char *buf, size_t size);
+int run_command_stream(FILE *fh);
+void stream_flush(struct path_batch *batch);
+int dispatch_command(struct command *cmd, struct path_batch *batch);
+int decode_command(const unsigned char *buf, size_t size, size_t *pos, struct command *cmd);
+int convert_commands(char text_name[], char binary_name[]);
+int encode_command(struct write_buffer *b, struct command *cmd);
+unsigned int get_u32le(const unsigned char *src);
+void put_u32le(unsigned char *dest, unsigned int value);
 
 /* Path search functions */
-int get_idx_in_visited(unsigned int routerID, struct router *ptr_array[]);
-int recursive_search(struct router *r_ptr,
-					 unsigned int findID,
-					 int *visited[],
-					 struct router *ptr_array[],
-					 unsigned int *path[],
-					 int *path_size,
-					 unsigned int **path_cur_ptr);
+int grow_array(void **array, size_t elem_size, int old_capacity, int capacity);
+int scratch_reserve(struct search_scratch *s, int capacity);
+void scratch_new_epoch(struct search_scratch *s);
+void scratch_free(struct search_scratch *s);
+int build_path(struct search_scratch *s, int *parent, int from_slot, int last_slot, int to_slot);
+int bfs_search(struct search_scratch *s, int from_slot, int to_slot);
+int build_bidir_path(struct search_scratch *s, int meet_from, int meet_to);
+int expand_forward(struct search_scratch *s, int *head, int *tail, int *best, int *meet_from, int *meet_to);
+int expand_backward(struct search_scratch *s, int *head, int *tail, int *best, int *meet_from, int *meet_to);
+int bidir_search(struct search_scratch *s, int from_slot, int to_slot);
+int search_path(struct search_scratch *s, int from_slot, int to_slot);
+struct reach_entry *reach_cache_lookup(int from_slot);
+struct reach_entry *reach_cache_build(struct search_scratch *s, int from_slot);
+int reach_cache_is_candidate(int from_slot);
+struct reach_entry *reach_cache_get(struct search_scratch *s, int from_slot);
+int reach_entry_path(struct search_scratch *s, struct reach_entry *e, int to_slot);
+int cached_search_path(struct search_scratch *s, int from_slot, int to_slot);
+void reach_cache_free();
+int answer_path(struct search_scratch *s, int from_slot, int to_slot);
+int find_path(struct search_scratch *s, int from_slot, int to_slot);
+void note_unreachable(struct search_scratch *s, int from_slot, int to_slot);
 int exists_path(unsigned int fromID, unsigned int toID);
+void print_search_result(FILE *out, unsigned int fromID, unsigned int toID, unsigned int *path, int path_len);
+
+/* Batched path search functions */
+int batch_add(struct path_batch *b, unsigned int fromID, unsigned int toID, int is_print);
+void batch_free(struct path_batch *b);
+void batch_reachability(int sources[], int n_sources, uint64_t *comp_bits);
+int batch_query_found(int from_slot, int to_slot, int k, uint64_t *comp_bits);
+long batch_budget(int n_queries);
+int batch_sweep(struct path_batch *b, struct search_scratch *s, int sources[], int n_sources, int remaining[], long budget, int *n_reached);
+int batch_add_jobs(struct path_batch *b, int count, unsigned char *found);
+int run_path_batch(struct path_batch *b);
+
+/* Parallel read run functions */
+struct read_job *read_run_add(enum read_job_kind kind, unsigned int fromID, unsigned int toID);
+int read_run_add_print(unsigned int routerID);
+int read_run_add_query(struct search_scratch *s, unsigned int fromID, unsigned int toID, int found);
+int read_run_flush();
+void read_run_count_query(struct read_job *job);
+void read_run_free();
+void run_job(struct read_job *job, struct search_scratch *s, FILE *out);
+void run_jobs(struct worker *w);
+void *worker_main(void *arg);
+int pool_start();
+void pool_run(void (*task)(struct worker *w));
+void decode_connections(struct worker *w);
+void build_rows(struct worker *w);
+void pool_free();
+
+/* Statistics functions */
+uint64_t stats_now();
+int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_low(int bucket);
+void histogram_add(struct histogram *h, uint64_t value);
+uint64_t histogram_percentile(struct histogram *h, double fraction);
+void histogram_write_json(FILE *fh, const char *name, struct histogram *h);
+void stats_record_command(enum command_kind kind, uint64_t ns, int failed);
+void stats_record_job(struct read_job *job);
+int stats_write();
+
+/* Daemon functions */
+int run_server(char socket_name[], char router_name[]);
+void server_signal(int signum);
+void *server_client(void *arg);
+void server_client_done(int slot);
+int server_read_command(struct command *cmd, struct search_scratch *s, FILE *out);
+int server_command(struct command *cmd, int fd, FILE *out);
+
+/* Snapshot functions */
+int snapshot_init();
+void snapshot_touch(int slot, int what);
+struct snapshot_page *snapshot_build_page(int page, struct snapshot_page *old, int what);
+int snapshot_publish();
+struct snapshot *snapshot_acquire();
+void snapshot_release(struct snapshot *g);
+void snapshot_page_release(struct snapshot_page *page);
+int snapshot_lookup(struct snapshot *g, unsigned int routerID);
+int snapshot_connections(struct snapshot *g, int slot, const int **conn);
+int snapshot_incoming(struct snapshot *g, int slot, const int **in);
+void snapshot_free();
+unsigned int graph_router_id(struct snapshot *g, int slot);
+void graph_router(struct snapshot *g, int slot, struct router_view *v);
+
+/* Validation functions */
+int validate_router_file(char filename[]);
+int validate_routers(struct validation *v, size_t *pos);
+void validate_records(struct worker *w);
+void validate_rows(struct worker *w);
+int validate_compare_records(const void *a, const void *b);
+void validate_run(void (*task)(struct worker *w));
+
+/* Output functions */
+void chunk_start(struct out_chunk *c, FILE *out);
+void chunk_flush(struct out_chunk *c);
+char *chunk_reserve(struct out_chunk *c, size_t n);
+void chunk_bytes(struct out_chunk *c, const void *src, size_t n);
+void chunk_string(struct out_chunk *c, const char *s);
+void chunk_uint(struct out_chunk *c, unsigned int value);
+void chunk_int(struct out_chunk *c, int value, int width);
+void chunk_hex(struct out_chunk *c, unsigned int value, int width);
+void chunk_json_string(struct out_chunk *c, const char *s, int len);
+void chunk_router_data(struct out_chunk *c, struct snapshot *g, int slot);
+void print_router_info(FILE *out, struct snapshot *g, int slot);
+void print_unknown_router(FILE *out, enum command_kind kind, unsigned int routerID);
 
 /* Printing, error handling and error printing*/
 int error_flag_file(FILE *fh, char calling_function[]);
 void cleanup_on_abort(FILE *router_file, FILE *commands_file);
-void print_router_data(struct router *r);
+void print_router_data(FILE *out, struct router *r);
 void print_invalid_bit_pos(unsigned char bit_pos, unsigned int routerID);
 void print_invalid_val(unsigned char bit_pos, unsigned char val, unsigned int routerID);
 void print_invalid_routerID(unsigned int(routerID));
-void print_path(unsigned int path[], unsigned int *path_cur_ptr);
+void print_missing_arguments(struct command *cmd);
+void print_path(struct out_chunk *c, unsigned int path[], unsigned int *path_cur_ptr);
+
+/* Reachability index functions */
+int scc_tarjan(int *component);
+int scc_build_labels();
+int scc_build();
+int scc_ensure_built();
+int scc_reachable(int from_slot, int to_slot);
+void scc_print_status();
+void scc_free();
 
 /* Helper functions */
 void print_sizeof_router();
 void print_all_router_data(struct router **array, int N);
-void print_visited_array(int visited[], struct router *ptr_array[]);
 
 /* Global array of struct pointers */
 struct router **router_array;
 
+/* Descriptions of routers, indexed by slot like router_array */
+struct router_desc *desc_store;
+
 /* Number of router information blocks in file */
 /* And actual number of routers during runtime */
 int N;
 int N_ROUTERS;
 
+/* Allocator of all router structs */
+struct router_arena router_arena;
+
+/* Connections of all routers */
+struct adjacency adjacency;
+
+/* Global index from routerID to slot in router_array */
+struct router_index router_index;
+
+/* Working memory shared by path searches in the main thread */
+struct search_scratch search_scratch;
+
+/* Search engine selected with option -s */
+enum search_mode search_mode = SEARCH_AUTO;
+
+/* Output format selected with option -o */
+enum output_mode output_mode = OUTPUT_TEXT;
+
+/*
+ * Incremented on every change to the connections between routers.
+ * Search results computed in an older epoch are no longer valid.
+ */
+unsigned long graph_epoch = 1;
+
+/* Cache of search trees, disabled with option -C */
+struct reach_cache reach_cache = { .enabled = TRUE };
+
+/* SCC index, enabled with option -I or command 'scc_indeks bygg' */
+struct scc_index scc_index;
+
+/* Journal of changes, written instead of the router file with option -j */
+struct journal journal;
+
+/* Read-only commands waiting to be executed */
+struct read_run read_run;
+
+/* Connection section being decoded at load */
+struct connection_load connection_load;
+
+/* Router file being checked with option -V */
+struct validation validation;
+
+/* Versions of the graph read by the daemon */
+struct snapshots snapshots = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Threads executing read runs, number set with option -t */
+struct worker_pool worker_pool = {
+		.n_threads = 1,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.work_ready = PTHREAD_COND_INITIALIZER,
+		.work_done = PTHREAD_COND_INITIALIZER
+};
+
+/* Statistics of the run, enabled with option -m */
+struct stats stats;
+
+/* Daemon state, and set by SIGINT or SIGTERM to stop the daemon */
+struct server server = {
+		.listen_fd = -1,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.clients_lock = PTHREAD_MUTEX_INITIALIZER,
+		.clients_done = PTHREAD_COND_INITIALIZER
+};
+volatile sig_atomic_t server_signalled;
+
 int main(int argc, char *argv[])
 {
-		/* Check number of arguments given */
-		if (argc != 3) {
-				printf("Usage: ./ruterdrift <router_descriptions> <commands.txt>\n");
+		/* Parse options, then check number of arguments given */
+		int opt;
+		int compact_only = FALSE;
+		int convert_only = FALSE;
+		int validate_only = FALSE;
+		char *socket_name = NULL;
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		worker_pool.n_threads = online < 1 ? 1 : online > MAX_THREADS ? MAX_THREADS : online;
+		while ((opt = getopt(argc, argv, "s:CIjcBVt:d:m:o:")) != -1) {
+				switch (opt) {
+				case 's':
+						if (strcmp(optarg, "forward") == 0)
+								search_mode = SEARCH_FORWARD;
+						else if (strcmp(optarg, "bidir") == 0)
+								search_mode = SEARCH_BIDIRECTIONAL;
+						else if (strcmp(optarg, "auto") == 0)
+								search_mode = SEARCH_AUTO;
+						else
+								argc = 0;  /* Invalid search mode, print usage below */
+						break;
+				case 'C':
+						reach_cache.enabled = FALSE;
+						break;
+				case 'I':
+						scc_index.enabled = TRUE;
+						break;
+				case 'j':
+						journal.enabled = TRUE;
+						break;
+				case 'c':
+						compact_only = TRUE;
+						break;
+				case 'B':
+						convert_only = TRUE;
+						break;
+				case 'V':
+						validate_only = TRUE;
+						break;
+				case 't':
+						worker_pool.n_threads = atoi(optarg);
+						if (worker_pool.n_threads < 1 || worker_pool.n_threads > MAX_THREADS)
+								argc = 0;  /* Invalid number of threads, print usage below */
+						break;
+				case 'd':
+						socket_name = optarg;
+						break;
+				case 'm':
+						stats.file = optarg;
+						stats.enabled = TRUE;
+						break;
+				case 'o':
+						if (strcmp(optarg, "text") == 0)
+								output_mode = OUTPUT_TEXT;
+						else if (strcmp(optarg, "json") == 0)
+								output_mode = OUTPUT_JSON;
+						else
+								argc = 0;  /* Invalid output format, print usage below */
+						break;
+				default:
+						argc = 0;
+				}
+		}
+		if (compact_only + validate_only + (socket_name != NULL) > 1)
+				argc = 0;
+		if (argc - optind != (compact_only || validate_only || socket_name ? 1 : 2)) {
+				printf("Usage: ./ruterdrift [-s forward|bidir|auto] [-C] [-I] [-j] [-t threads] [-m stats.json] [-o text|json] <router_descriptions> <commands.txt>\n");
+				printf("       ./ruterdrift -d <socket> [-s forward|bidir|auto] [-C] [-I] [-j] [-o text|json] <router_descriptions>\n");
+				printf("       ./ruterdrift -c <router_descriptions>\n");
+				printf("       ./ruterdrift -V [-t threads] <router_descriptions>\n");
+				printf("       ./ruterdrift -B <commands.txt> <commands.bin>\n");
 				printf("Exiting\n");
 				return EXIT_FAILURE;
 		}
+		argv += optind - 1;
+
+		/* Output to a file or pipe is written in large blocks */
+		if (!(isatty(STDOUT_FILENO)))
+				setvbuf(stdout, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+		/* With option -B, only compile the commands-file to binary form */
+		if (convert_only)
+				return convert_commands(argv[1], argv[2]) == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+
+		/* With option -V, only check the router file */
+		if (validate_only) {
+				int valid = validate_router_file(argv[1]);
+				pool_free();
+				return valid == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
 
 		/* Open files, exit on fail
 		 * Close files when all operations (reading router-info and commands)
-		 * are finished and before file is reopened to be written to. */
+		 * are finished and before the router file is replaced.
+		 * With option -c there are no commands, only the journal is compacted,
+		 * and with option -d commands come from the socket. */
+		int has_commands = !(compact_only) && !(socket_name);
 		FILE *router_file = open_file(argv[1], "rb");
-		FILE *commands_file = open_file(argv[2], "r");
-		if (!(router_file) || !(commands_file))
+		FILE *commands_file = NULL;
+		if (has_commands)
+				commands_file = strcmp(argv[2], "-") == 0 ? stdin : open_file(argv[2], "r");
+		if (!(router_file) || (has_commands && !(commands_file)))
 				return EXIT_FAILURE;
 
-		/* Set N (number of routers in description file) */
-		fread(&N, sizeof(int), 1, router_file);
-		N_ROUTERS = N;
-
 		/*
-		 * Allocate memory to global array of pointers to router structs,
-		 * and fill structs with info from the given file.
-		 * Size depends on N, number of router info blocks in input file,
-		 * with size of 8 bytes per pointer.
+		 * Read routers and connections from the router file into the global
+		 * router_array, and apply changes journaled by earlier runs.
 		 * Memory allocated is freed at end of main.
 		 */
-		int result;
-		router_array = malloc(sizeof(struct router*) * N);
-		create_all_routers(router_array, router_file, N);
-		result = set_all_connections(router_file);
-		if (result == CRITICAL_FAILURE) {
-				fprintf(stderr, "\n%s*Critical error*%s: when setting connections between routers.", CLR_RED, CLR_NRM);
+		uint64_t start = stats.enabled ? stats_now() : 0;
+		int result = load_router_file(router_file);
+		if (result == SUCCESS)
+				result = journal_replay(argv[1], router_file);
+		if (result == SUCCESS && journal.enabled && !(compact_only))
+				result = journal_open();
+		if (stats.enabled)
+				stats.phase_ns[PHASE_LOAD] = stats_now() - start;
+		if (result != SUCCESS) {
+				fprintf(stderr, "\n%s*Critical error*%s: when reading routers and connections.", CLR_RED, CLR_NRM);
 				fprintf(stderr, " Aborting program to avoid an invalid write to file.\n\n");
 				cleanup_on_abort(router_file, commands_file);
 				return EXIT_FAILURE;
@@ -136,7 +1164,14 @@ int main(int argc, char *argv[])
 		 * from 'kommando-fil'. This to avoid a write from possible inconsistent
 		 * state to router_file.
 		 */
-		result = run_all_commands(commands_file);
+		if (stats.enabled)
+				start = stats_now();
+		if (socket_name)
+				result = run_server(socket_name, argv[1]);
+		else if (!(compact_only))
+				result = run_all_commands(commands_file);
+		if (stats.enabled)
+				stats.phase_ns[PHASE_COMMANDS] = stats_now() - start;
 		if (result == CRITICAL_FAILURE) {
 				fprintf(stderr, "\n%s*Critical error*%s: during execution of commands.", CLR_RED, CLR_NRM);
 				fprintf(stderr, " Aborting program to avoid an invalid write to file.\n\n");
@@ -146,25 +1181,47 @@ int main(int argc, char *argv[])
 
 		/* Close filehandles initialized at beginning of program */
 		fclose(router_file);
-		fclose(commands_file);
-
-		/* Open router file for writing */
-		/* Is closed in main just after write_to_file() is finished */
-		router_file = open_file(argv[1], "wb");
-		/* router_file = open_file("./output", "wb"); */  /* DEBUG */
-		if (!(router_file))
-				return EXIT_FAILURE;
-
-		/* Write information in router_array to file and close file */
-		write_to_file(router_file);
-		fclose(router_file);
+		if (commands_file)
+				fclose(commands_file);
+
+		/* Write the changes to the journal (option -j), or write information
+		 * in router_array back to router file, which folds in the journal */
+		int saved;
+		if (stats.enabled)
+				start = stats_now();
+		if (journal.enabled && !(compact_only)) {
+				saved = journal_close();
+		} else {
+				saved = save_router_file(argv[1]);
+				/* int saved = save_router_file("./output"); */  /* DEBUG */
+				if (saved == SUCCESS)
+						journal_discard();
+		}
+		journal_free();
+		if (stats.enabled) {
+				stats.phase_ns[PHASE_WRITE] = stats_now() - start;
+				stats_write();
+		}
 
 		/* Free all allocated memory to struct-pointers in global array */
 		/* and free memory to array of these pointers. */
 		/* Memory to router_array was allocated at beginning of main */
 		remove_all_routers();
 		free(router_array);
-
+		free(desc_store);
+		adjacency_free();
+		index_free();
+		scratch_free(&search_scratch);
+		reach_cache_free();
+		scc_free();
+		read_run_free();
+		pool_free();
+
+		if (saved != SUCCESS)
+				return EXIT_FAILURE;
+		/* In JSON mode stdout holds only the objects of the commands */
+		if (output_mode == OUTPUT_JSON)
+				return EXIT_SUCCESS;
 		if (result != SUCCESS)
 				puts("\n-- Exited, possibly with unfinished commands --");
 		else
@@ -192,6 +1249,117 @@ FILE *open_file(char filename[], char mode[])
 }
 
 
+/*
+ * Reads the router file <FILE *fh> into the global router_array and index.
+ * Regular files are memory mapped and parsed in place; other files (pipes,
+ * devices) or files which can not be mapped are read with stdio.
+ * Returns SUCCESS, or FAILURE/CRITICAL_FAILURE if the file could not be read.
+ */
+int load_router_file(FILE *fh)
+{
+		struct stat st;
+		if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+				int result = load_router_file_mmap(fh, st.st_size);
+				if (result != FAILURE)
+						return result;
+		}
+		return load_router_file_stdio(fh);
+}
+
+
+/*
+ * Allocate memory to global array of pointers to router structs, to the
+ * description store and to the router index, for <int num_routers> routers,
+ * and set N and N_ROUTERS.
+ * Size depends on N, number of router info blocks in input file,
+ * with size of 8 bytes per pointer and 249 bytes per description.
+ */
+int allocate_router_array(int num_routers)
+{
+		if (num_routers < 0)
+				num_routers = 0;
+		router_array = malloc(sizeof(struct router*) * (num_routers > 0 ? num_routers : 1));
+		desc_store = malloc(sizeof(struct router_desc) * (num_routers > 0 ? num_routers : 1));
+		if (!(router_array) || !(desc_store) || index_init(num_routers) != SUCCESS) {
+				perror("Error with malloc");
+				free(router_array);
+				free(desc_store);
+				router_array = NULL;
+				desc_store = NULL;
+				return FAILURE;
+		}
+		N = num_routers;
+		N_ROUTERS = num_routers;
+		return SUCCESS;
+}
+
+
+/*
+ * Maps the regular file <FILE *fh> of <size_t size> bytes and parses the
+ * router blocks and connection records directly from the mapping, checking
+ * bounds instead of relying on eof. The mapping is removed before returning.
+ * Returns FAILURE if the file could not be mapped (nothing is loaded then),
+ * CRITICAL_FAILURE if it is incorrectly formatted, SUCCESS otherwise.
+ */
+int load_router_file_mmap(FILE *fh, size_t size)
+{
+		const unsigned char *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+		if (buf == MAP_FAILED)
+				return FAILURE;
+		madvise((void *) buf, size, MADV_SEQUENTIAL);
+
+		/* Set N (number of routers in description file) */
+		int num_routers = 0;
+		if (size >= sizeof(int))
+				memcpy(&num_routers, buf, sizeof(int));
+		if (allocate_router_array(num_routers) != SUCCESS) {
+				munmap((void *) buf, size);
+				return CRITICAL_FAILURE;
+		}
+
+		size_t pos = sizeof(int);
+		int result = SUCCESS;
+		for (int i = 0; i < N; i++) {
+				router_array[i] = create_router_from_buffer(buf, size, &pos, i);
+				if (!(router_array[i])) {
+						/* Keep the array valid for cleanup */
+						for (int j = i + 1; j < N; j++)
+								router_array[j] = NULL;
+						result = CRITICAL_FAILURE;
+						break;
+				}
+				index_insert(router_array[i]->routerID, i);
+		}
+		if (result == SUCCESS)
+				result = set_all_connections_from_buffer(buf, size, pos);
+		if (result == SUCCESS && adjacency_build() != SUCCESS)
+				result = CRITICAL_FAILURE;
+
+		munmap((void *) buf, size);
+		return result;
+}
+
+
+/*
+ * Reads the router file <FILE *fh> with stdio, block by block.
+ * Returns CRITICAL_FAILURE if the file could not be read, SUCCESS otherwise.
+ */
+int load_router_file_stdio(FILE *fh)
+{
+		/* Set N (number of routers in description file) */
+		int num_routers = 0;
+		fread(&num_routers, sizeof(int), 1, fh);
+		if (allocate_router_array(num_routers) != SUCCESS)
+				return CRITICAL_FAILURE;
+
+		create_all_routers(router_array, fh, N);
+		int result = set_all_connections(fh);
+		if (result == SUCCESS && adjacency_build() != SUCCESS)
+				result = CRITICAL_FAILURE;
+		return result;
+}
+
+
 /*
  * According to specification, if the max size of the information block is
  * used (256 bytes) there will always be at least 1 undefined byte before the
@@ -230,108 +1398,560 @@ int get_num_from_stream(unsigned int* number, FILE *fh)
 
 
 /*
- * Function writes information from program back to the file given as filename
- * argument <char filename[]>. It first writes the integer defining the number
+ * Writes the routers back to the file <char filename[]> without ever leaving
+ * it half written: the file is written to a temporary file in the same
+ * directory, which is synced and then renamed over the original, and the
+ * directory is synced so the rename is durable too. A symbolic link is
+ * followed, so the file it points to is replaced and the link kept.
+ * Files which are not regular files (pipes, devices) are written in place.
+ * Returns FAILURE (after printing an error) if the file could not be
+ * written; the original file is then left as it was, unless only the sync
+ * of the directory failed.
+ */
+int save_router_file(char filename[])
+{
+		char *target = realpath(filename, NULL);
+		if (target)
+				filename = target;
+
+		struct stat st;
+		int exists = stat(filename, &st) == 0;
+		if (exists && !(S_ISREG(st.st_mode))) {
+				int fd = open(filename, O_WRONLY | O_TRUNC);
+				if (fd == -1) {
+						fprintf(stderr, "%sError%s when trying to open file called '%s':\n      ", CLR_RED, CLR_NRM, filename);
+						perror("");
+						free(target);
+						return FAILURE;
+				}
+				int result = write_to_file(fd);
+				close(fd);
+				free(target);
+				return result;
+		}
+
+		char *tmp_name = malloc(strlen(filename) + sizeof(".XXXXXX"));
+		if (!(tmp_name)) {
+				perror("Error with malloc");
+				free(target);
+				return FAILURE;
+		}
+		sprintf(tmp_name, "%s.XXXXXX", filename);
+		int fd = mkstemp(tmp_name);
+		if (fd == -1) {
+				fprintf(stderr, "%sError%s when trying to create temporary file '%s':\n      ", CLR_RED, CLR_NRM, tmp_name);
+				perror("");
+				free(tmp_name);
+				free(target);
+				return FAILURE;
+		}
+		/* Keep the permissions of the original file */
+		if (fchmod(fd, exists ? st.st_mode & 07777 : 0644) != 0) {
+				fprintf(stderr, "%sWarning%s: could not set the permissions of '%s': ", CLR_RED, CLR_NRM, filename);
+				perror("");
+		}
+
+		int result = write_to_file(fd);
+		if (result == SUCCESS && fsync(fd) != 0) {
+				fprintf(stderr, "%sError%s when syncing file '%s': ", CLR_RED, CLR_NRM, tmp_name);
+				perror("");
+				result = FAILURE;
+		}
+		if (close(fd) != 0)
+				result = FAILURE;
+		if (result == SUCCESS && rename(tmp_name, filename) != 0) {
+				fprintf(stderr, "%sError%s when replacing file '%s': ", CLR_RED, CLR_NRM, filename);
+				perror("");
+				result = FAILURE;
+		}
+		if (result != SUCCESS) {
+				fprintf(stderr, "Router file '%s' was left unchanged.\n", filename);
+				unlink(tmp_name);
+		} else if (sync_directory(filename) != SUCCESS) {
+				result = FAILURE;
+		}
+		free(tmp_name);
+		free(target);
+		return result;
+}
+
+
+/*
+ * Syncs the directory holding the file <char filename[]>, so that a rename
+ * into it is on disk. Returns FAILURE (after printing an error) if the
+ * directory could not be opened or synced.
+ */
+int sync_directory(char filename[])
+{
+		char *slash = strrchr(filename, '/');
+		char *dir_name = slash ? strndup(filename, slash == filename ? 1 : slash - filename) : strdup(".");
+		if (!(dir_name)) {
+				perror("Error with malloc");
+				return FAILURE;
+		}
+		int result = SUCCESS;
+		int fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+		if (fd == -1 || fsync(fd) != 0) {
+				fprintf(stderr, "%sError%s when syncing directory '%s': ", CLR_RED, CLR_NRM, dir_name);
+				perror("");
+				result = FAILURE;
+		}
+		if (fd != -1)
+				close(fd);
+		free(dir_name);
+		return result;
+}
+
+
+/*
+ * Function writes information from program to the file given by the file
+ * descriptor <int fd>. It first writes the integer defining the number
  * routers described in file. It then writes the information blocks on the
  * routers before calling a function which writes information on all connections
- * to file.
+ * to file. Everything is serialized into one large buffer, written whenever
+ * it is full.
+ * Returns FAILURE (after printing an error) if a write failed.
  */
-int write_to_file(FILE *fh)
+int write_to_file(int fd)
 {
-		unsigned char term_byte = 0;
-		struct router *r;
+		struct write_buffer b = { .fd = fd };
+		b.data = malloc(WRITE_BUFFER_SIZE);
+		if (!(b.data)) {
+				perror("Error with malloc");
+				return FAILURE;
+		}
 
-		fwrite(&N_ROUTERS, sizeof(int), 1, fh);
-		for (int i = 0; i < N; i++) {
+		unsigned char *dest = wbuf_reserve(&b, sizeof(int));
+		memcpy(dest, &N_ROUTERS, sizeof(int));
+		struct router *r;
+		for (int i = 0; i < N && !(b.failed); i++) {
 				r = *(router_array + i);
 				if (r) {
-						/* Writing the 7 first bytes directly from struct to file */
+						/* Writing the 6 first bytes (id, flag, desc_len) */
 						/* since these are static/of unchanged size according to spec. */
 						/* Then writing the prod/model. string (without terminating 0)*/
 						/* And then writing a term_byte (0) */
-						fwrite(r, sizeof(unsigned char), 6, fh);
-						fwrite(r->description, sizeof(char), r->desc_len, fh);
-						fwrite(&term_byte, sizeof(unsigned char), 1, fh);
-
-						/* Checking error flag each iteration */
-						if (error_flag_file(fh, "write_to_file"))
-								return FAILURE;
+						dest = wbuf_reserve(&b, HEADER_SIZE + desc_store[i].desc_len + 1);
+						write_router_header(dest, r);
+						memcpy(dest + HEADER_SIZE, desc_store[i].description, desc_store[i].desc_len);
+						dest[HEADER_SIZE + desc_store[i].desc_len] = 0;
 				}
 		}
 
-		write_connections_to_file(fh);
-
-		return SUCCESS;
+		write_connections_to_file(&b);
+		int result = wbuf_flush(&b);
+		free(b.data);
+		return result;
 }
 
 
 /*
  * Writes information on all connections between routers
- * to file given as argument <FILE *fh>.
+ * to the buffer given as argument <struct write_buffer *b>.
  */
-int write_connections_to_file(FILE *fh)
+int write_connections_to_file(struct write_buffer *b)
 {
-		unsigned char term_byte = 0;
 		unsigned int toID;
 		unsigned int fromID;
+		unsigned char *dest;
 		struct router *r;
-		struct router **conn;
+		int *conn;
 
 		/* For each router */
-		for (int i = 0; i < N; i++) {
+		for (int i = 0; i < N && !(b->failed); i++) {
 				r = *(router_array + i);
 				if (r) {
 						fromID = r->routerID;
-						conn = r->connections;
-						/* For each connection for current router */
-						/* If it exists, write info on connection to file */
-						for (int j = 0; j < MAX_CONNECTIONS; j++) {
-								if (conn[j]) {
-										toID = (*(conn + j))->routerID;
-										fwrite(&fromID, sizeof(unsigned int), 1, fh);
-										fwrite(&toID, sizeof(unsigned int), 1, fh);
-										fwrite(&term_byte, sizeof(unsigned char), 1, fh);
-								}
+						conn = adjacency.target + r->conn_start;
+						/* Write a record on each connection of current router */
+						for (int j = 0; j < r->n_conn; j++) {
+								toID = router_array[conn[j]]->routerID;
+								dest = wbuf_reserve(b, CONNECTION_RECORD_SIZE);
+								memcpy(dest, &fromID, sizeof(unsigned int));
+								memcpy(dest + sizeof(unsigned int), &toID, sizeof(unsigned int));
+								dest[2 * sizeof(unsigned int)] = 0;
 						}
-
-						if (error_flag_file(fh, "write_connections_to_file"))
-								return FAILURE;
 				}
 		}
-		return SUCCESS;
+		return b->failed ? FAILURE : SUCCESS;
 }
 
 
-
-/* --- ROUTER/ROUTING FUNCTIONS --- */
-
 /*
- * Allocate memory to a struct. Read information block in file (given by FILE fh)
- * to this struct. Function leaves filehandler pointing to the next byte
+ * Returns room for <size_t n> bytes (at most BLOCK_MAX_SIZE) at the end of
+ * the write buffer <struct write_buffer *b>, writing out the buffer first if
+ * it is too full.
+ */
+unsigned char *wbuf_reserve(struct write_buffer *b, size_t n)
+{
+		if (b->len + n > WRITE_BUFFER_SIZE)
+				wbuf_flush(b);
+		unsigned char *dest = b->data + b->len;
+		b->len += n;
+		return dest;
+}
+
+
+/*
+ * Writes the contents of the write buffer <struct write_buffer *b> to its
+ * file, and empties it. Retries short writes and interrupted writes.
+ * Returns FAILURE (after printing an error) if any write has failed.
+ */
+int wbuf_flush(struct write_buffer *b)
+{
+		size_t done = 0;
+		while (!(b->failed) && done < b->len) {
+				ssize_t n = write(b->fd, b->data + done, b->len - done);
+				if (n < 0 && errno == EINTR)
+						continue;
+				if (n <= 0) {
+						fprintf(stderr, "%sError%s when writing to file. ", CLR_RED, CLR_NRM);
+						perror("");
+						b->failed = TRUE;
+						break;
+				}
+				done += n;
+		}
+		b->len = 0;
+		return b->failed ? FAILURE : SUCCESS;
+}
+
+
+
+/* --- JOURNAL FUNCTIONS --- */
+
+/*
+ * Applies the journal of the router file <char filename[]> (the file name
+ * with JOURNAL_SUFFIX), if there is one, to the routers just loaded from
+ * <FILE *router_file>. A journal which does not belong to the router file
+ * is ignored with a warning, and replay stops with a warning at the first
+ * incomplete or unknown record.
+ * The journal needs a regular router file; for other files option -j is
+ * turned off. Returns CRITICAL_FAILURE if a record could not be applied
+ * (allocation failure), SUCCESS otherwise.
+ */
+int journal_replay(char filename[], FILE *router_file)
+{
+		struct stat st;
+		if (fstat(fileno(router_file), &st) != 0 || !(S_ISREG(st.st_mode))) {
+				if (journal.enabled)
+						fprintf(stderr, "%sWarning%s: journal needs a regular router file. Writing the whole file instead.\n", CLR_RED, CLR_NRM);
+				journal.enabled = FALSE;
+				return SUCCESS;
+		}
+		journal.base_size = st.st_size;
+		journal.base_sec = st.st_mtim.tv_sec;
+		journal.base_nsec = st.st_mtim.tv_nsec;
+		journal.name = malloc(strlen(filename) + sizeof(JOURNAL_SUFFIX));
+		if (!(journal.name)) {
+				perror("Error with malloc");
+				return CRITICAL_FAILURE;
+		}
+		sprintf(journal.name, "%s%s", filename, JOURNAL_SUFFIX);
+
+		/* Read the whole journal, if there is one */
+		FILE *fh = fopen(journal.name, "rb");
+		if (!(fh))
+				return SUCCESS;
+		unsigned char *buf = NULL;
+		size_t size = 0;
+		if (fstat(fileno(fh), &st) == 0 && st.st_size > 0) {
+				size = st.st_size;
+				buf = malloc(size);
+				if (!(buf)) {
+						perror("Error with malloc");
+						fclose(fh);
+						return CRITICAL_FAILURE;
+				}
+				size = fread(buf, 1, size, fh);
+		}
+		fclose(fh);
+
+		uint64_t header[3];
+		if (size >= JOURNAL_HEADER_SIZE)
+				memcpy(header, buf + 4, sizeof(header));
+		if (size < JOURNAL_HEADER_SIZE || memcmp(buf, JOURNAL_MAGIC, 4) != 0 || header[0] != journal.base_size
+					|| header[1] != journal.base_sec || header[2] != journal.base_nsec) {
+				fprintf(stderr, "%sWarning%s: journal '%s' does not belong to router file '%s'. Ignoring it.\n", CLR_RED, CLR_NRM, journal.name, filename);
+				free(buf);
+				return SUCCESS;
+		}
+
+		size_t pos = JOURNAL_HEADER_SIZE;
+		int result = SUCCESS;
+		while (pos < size && result == SUCCESS) {
+				result = journal_apply(buf, size, &pos);
+				if (result == FAILURE) {
+						fprintf(stderr, "%sWarning%s: journal '%s' has an incomplete or unknown record at byte %zu.", CLR_RED, CLR_NRM, journal.name, pos);
+						fprintf(stderr, " Ignoring the rest of it.\n");
+				}
+		}
+		journal.valid = TRUE;
+		journal.valid_len = pos;
+		free(buf);
+		return result == CRITICAL_FAILURE ? CRITICAL_FAILURE : SUCCESS;
+}
+
+
+/*
+ * Applies the journal record starting at <size_t *pos> in <const unsigned
+ * char *buf> of <size_t size> bytes, and moves *pos past it. Records on
+ * routers which no longer exist are skipped.
+ * Returns FAILURE (leaving *pos) if the record is incomplete or unknown,
+ * CRITICAL_FAILURE if a connection could not be set, SUCCESS otherwise.
+ */
+int journal_apply(const unsigned char *buf, size_t size, size_t *pos)
+{
+		size_t left = size - *pos;
+		const unsigned char *rec = buf + *pos;
+		unsigned int routerID, toID;
+		struct router *r, *to;
+		if (left < 1 + sizeof(unsigned int))
+				return FAILURE;
+		memcpy(&routerID, rec + 1, sizeof(unsigned int));
+		r = find_router(routerID);
+
+		switch (rec[0]) {
+		case JOURNAL_FLAG:
+				if (left < 6)
+						return FAILURE;
+				if (r)
+						r->flag = rec[5];
+				*pos += 6;
+				break;
+		case JOURNAL_MODEL:
+				if (left < 6 || rec[5] > DESC_MAX_LEN || left - 6 < rec[5])
+						return FAILURE;
+				if (r) {
+						desc_store[r->slot].desc_len = rec[5];
+						memcpy(desc_store[r->slot].description, rec + 6, rec[5]);
+				}
+				*pos += 6 + rec[5];
+				break;
+		case JOURNAL_CONNECTION:
+				if (left < 9)
+						return FAILURE;
+				memcpy(&toID, rec + 5, sizeof(unsigned int));
+				to = find_router(toID);
+				if (r && to && is_connected(r, toID) == FALSE && set_connection(r, to) != SUCCESS)
+						return CRITICAL_FAILURE;
+				*pos += 9;
+				break;
+		case JOURNAL_REMOVE:
+				if (r)
+						remove_router(routerID);
+				*pos += 5;
+				break;
+		default:
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+/*
+ * Opens the journal for appending records of this run. A journal which
+ * was not replayed (missing or not belonging to the router file) is
+ * started over, and anything after the last complete record is cut off.
+ * Returns FAILURE (after printing an error) if it could not be opened.
+ */
+int journal_open()
+{
+		journal.buf.fd = open(journal.name, O_WRONLY | O_CREAT, 0644);
+		if (journal.buf.fd == -1) {
+				fprintf(stderr, "%sError%s when trying to open journal '%s':\n      ", CLR_RED, CLR_NRM, journal.name);
+				perror("");
+				return FAILURE;
+		}
+		journal.buf.data = malloc(WRITE_BUFFER_SIZE);
+		if (!(journal.buf.data)) {
+				perror("Error with malloc");
+				close(journal.buf.fd);
+				return FAILURE;
+		}
+		if (!(journal.valid))
+				journal.valid_len = 0;
+		if (ftruncate(journal.buf.fd, journal.valid_len) != 0 || lseek(journal.buf.fd, 0, SEEK_END) == -1) {
+				fprintf(stderr, "%sError%s when preparing journal '%s': ", CLR_RED, CLR_NRM, journal.name);
+				perror("");
+				close(journal.buf.fd);
+				free(journal.buf.data);
+				journal.buf.data = NULL;
+				return FAILURE;
+		}
+		if (!(journal.valid))
+				journal_write_header();
+		return SUCCESS;
+}
+
+
+/*
+ * Writes the records of this run to the journal, syncs it to disk and
+ * closes it. Returns FAILURE (after printing an error) if this failed;
+ * the router file itself is then still as it was.
+ */
+int journal_close()
+{
+		int result = journal_sync();
+		if (close(journal.buf.fd) != 0)
+				result = FAILURE;
+		free(journal.buf.data);
+		journal.buf.data = NULL;
+		return result;
+}
+
+
+/*
+ * Writes the records so far to the journal and syncs it to disk.
+ * Returns FAILURE (after printing an error) if this failed.
+ */
+int journal_sync()
+{
+		if (wbuf_flush(&journal.buf) != SUCCESS)
+				return FAILURE;
+		if (fsync(journal.buf.fd) != 0) {
+				fprintf(stderr, "%sError%s when syncing journal '%s': ", CLR_RED, CLR_NRM, journal.name);
+				perror("");
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+/* Deletes the journal, after its changes are written to the router file */
+void journal_discard()
+{
+		if (journal.name && unlink(journal.name) != 0 && errno != ENOENT) {
+				fprintf(stderr, "%sWarning%s: could not delete journal '%s': ", CLR_RED, CLR_NRM, journal.name);
+				perror("");
+		}
+}
+
+
+/* Writes JOURNAL_MAGIC and the size and time of the router file */
+void journal_write_header()
+{
+		uint64_t header[3] = { journal.base_size, journal.base_sec, journal.base_nsec };
+		unsigned char *dest = wbuf_reserve(&journal.buf, JOURNAL_HEADER_SIZE);
+		memcpy(dest, JOURNAL_MAGIC, 4);
+		memcpy(dest + 4, header, sizeof(header));
+}
+
+
+/* Records the flag of <struct router *r>, if the journal is open */
+void journal_record_flag(struct router *r)
+{
+		if (!(journal.buf.data))
+				return;
+		unsigned char *dest = wbuf_reserve(&journal.buf, 6);
+		dest[0] = JOURNAL_FLAG;
+		memcpy(dest + 1, &r->routerID, sizeof(unsigned int));
+		dest[5] = r->flag;
+}
+
+
+/* Records the description of <struct router *r>, if the journal is open */
+void journal_record_model(struct router *r)
+{
+		if (!(journal.buf.data))
+				return;
+		struct router_desc *d = &desc_store[r->slot];
+		unsigned char *dest = wbuf_reserve(&journal.buf, 6 + d->desc_len);
+		dest[0] = JOURNAL_MODEL;
+		memcpy(dest + 1, &r->routerID, sizeof(unsigned int));
+		dest[5] = d->desc_len;
+		memcpy(dest + 6, d->description, d->desc_len);
+}
+
+
+/* Records a new connection, if the journal is open */
+void journal_record_connection(unsigned int fromID, unsigned int toID)
+{
+		if (!(journal.buf.data))
+				return;
+		unsigned char *dest = wbuf_reserve(&journal.buf, 9);
+		dest[0] = JOURNAL_CONNECTION;
+		memcpy(dest + 1, &fromID, sizeof(unsigned int));
+		memcpy(dest + 5, &toID, sizeof(unsigned int));
+}
+
+
+/* Records the removal of a router, if the journal is open */
+void journal_record_remove(unsigned int routerID)
+{
+		if (!(journal.buf.data))
+				return;
+		unsigned char *dest = wbuf_reserve(&journal.buf, 5);
+		dest[0] = JOURNAL_REMOVE;
+		memcpy(dest + 1, &routerID, sizeof(unsigned int));
+}
+
+
+/* Frees the journal name and buffer */
+void journal_free()
+{
+		free(journal.name);
+		free(journal.buf.data);
+		journal.name = NULL;
+		journal.buf.data = NULL;
+}
+
+
+
+/* --- ROUTER/ROUTING FUNCTIONS --- */
+
+/*
+ * Allocate memory to a struct from the router arena, with no connections.
+ * Size (in bytes): 8 + 8 + 6 * 4 + 1 = 41, padded to 48.
+ * The description lives in desc_store, and the connections in adjacency.
+ * Memory is returned to the arena in remove_router(), and released
+ * altogether by remove_all_routers().
+ */
+struct router *new_router()
+{
+		struct router *r = arena_alloc();
+		if (!(r))
+				return NULL;
+
+		/* Initialize connections and reverse adjacency to empty */
+		r->conn_start = 0;
+		r->n_conn = 0;
+		r->conn_room = 0;
+		r->incoming = NULL;
+		r->n_incoming = 0;
+		r->incoming_cap = 0;
+		r->slot = -1;
+		r->hashed = FALSE;
+		return r;
+}
+
+
+/*
+ * Allocate memory to a struct. Read information block in file (given by FILE fh)
+ * to this struct, and the description to desc_store at <int slot>.
+ * Function leaves filehandler pointing to the next byte
  * just after the terminating 0 in each information block.
  */
-struct router *create_router(FILE *fh)
+struct router *create_router(FILE *fh, int slot)
 {
-		/* Allocate memory, size of struct router.
-		 * Size (in bytes): 6 + (DESC_MAX_LEN * (sizeof char)) + (MAX_CONNECTIONS * (sizeof ptr))
-		 * = 6 + 248 + 80 = 334
-		 * Memory is freed in remove_router() */
-		struct router *r = malloc(sizeof(struct router));
+		struct router *r = new_router();
 		if (!(r))
-				perror("Error with malloc");
+				return NULL;
+		r->slot = slot;
 
-		/* Reads routerID, flag and desc_len to struct *r */
-		fread(r, sizeof(char), 6, fh);
-		if (error_flag_file(fh, "create_router"))
+		/* Reads routerID, flag and desc_len */
+		unsigned char header[HEADER_SIZE] = { 0 };
+		fread(header, sizeof(char), HEADER_SIZE, fh);
+		if (error_flag_file(fh, "create_router")) {
+				arena_release(r);
 				return NULL;
+		}
+		read_router_header(r, header);
 		/* Read in description (producer/model) */
-		fread(r->description, sizeof(char), r->desc_len, fh);
-		if (error_flag_file(fh, "create_router"))
+		fread(desc_store[slot].description, sizeof(char), desc_store[slot].desc_len, fh);
+		if (error_flag_file(fh, "create_router")) {
+				arena_release(r);
 				return NULL;
-
-		/* Initialize connections to NULL */
-		for(int i = 0; i < MAX_CONNECTIONS; i++) {
-				r->connections[i] = NULL;
 		}
 
 		/* Get file pointer to the end of information block*/
@@ -340,32 +1960,83 @@ struct router *create_router(FILE *fh)
 }
 
 
+/*
+ * Create a router in <int slot> from the information block starting at
+ * <size_t *pos> in <const unsigned char *buf> of <size_t size> bytes, and move
+ * *pos to the byte just after the terminating 0 of the block.
+ * Returns NULL (after printing an error) if the block runs past the buffer.
+ */
+struct router *create_router_from_buffer(const unsigned char *buf, size_t size, size_t *pos, int slot)
+{
+		if (size - *pos < HEADER_SIZE || size - *pos - HEADER_SIZE < buf[*pos + 5]) {
+				fprintf(stderr, "%sError%s: router information block at byte %zu ends past end of file\n", CLR_RED, CLR_NRM, *pos);
+				return NULL;
+		}
+		size_t desc_end = *pos + HEADER_SIZE + buf[*pos + 5];
+		const unsigned char *end = memchr(buf + desc_end, 0, size - desc_end);
+		if (!(end)) {
+				fprintf(stderr, "%sError%s: router information block at byte %zu has no terminating 0\n", CLR_RED, CLR_NRM, *pos);
+				return NULL;
+		}
+
+		struct router *r = new_router();
+		if (!(r))
+				return NULL;
+		r->slot = slot;
+
+		/* Copies routerID, flag and desc_len, then description (producer/model) */
+		read_router_header(r, buf + *pos);
+		memcpy(desc_store[slot].description, buf + *pos + HEADER_SIZE, desc_store[slot].desc_len);
+		*pos = end - buf + 1;
+		return r;
+}
+
+
+/*
+ * Sets routerID and flag of <struct router *r>, and desc_len in its
+ * description, from the first 6 bytes of an information block <header>.
+ */
+void read_router_header(struct router *r, const unsigned char header[])
+{
+		memcpy(&r->routerID, header, sizeof(unsigned int));
+		r->flag = header[4];
+		desc_store[r->slot].desc_len = header[5];
+}
+
+
+/* Writes the first 6 bytes of the information block of <struct router *r> */
+void write_router_header(unsigned char header[], struct router *r)
+{
+		memcpy(header, &r->routerID, sizeof(unsigned int));
+		header[4] = r->flag;
+		header[5] = desc_store[r->slot].desc_len;
+}
+
+
 /*
  * Create structs for each struct router pointer in the array
  * <struct router **dest>. Information for each struct is provided
  * by <FILE *fh>.The number of struct pointers in array is given by <int N>.
+ * Each created router is registered in the global router index.
 */
 int create_all_routers(struct router **dest, FILE *fh, int N)
 {
 		for(int i = 0; i < N; i++) {
-				*(dest + i) = create_router(fh);
+				*(dest + i) = create_router(fh, i);
+				if (dest[i])
+						index_insert(dest[i]->routerID, i);
 		}
 		return SUCCESS;
 }
 
 
-/* Returns pointer to router with the corresponding routerID */
+/*
+ * Returns pointer to router with the corresponding routerID.
+ * Prints a warning if no such router exists.
+ */
 struct router *get_router(unsigned int routerID)
 {
-		struct router *r = NULL;
-		struct router *compare_router;
-		/* While router still not found (r_ptr == NULL),
-		 * and i is less than number of routers in router_array */
-		for (int i = 0; i < N && r == NULL; i++) {
-				compare_router = router_array[i];
-				if (compare_router && routerID == compare_router->routerID)
-				        r = compare_router;
-		}
+		struct router *r = find_router(routerID);
 		if (!(r))
 				printf("%sWarning%s: Could not find router with id %d.\n", CLR_RED, CLR_NRM, routerID);
 
@@ -373,6 +2044,19 @@ struct router *get_router(unsigned int routerID)
 }
 
 
+/*
+ * Silent variant of get_router(). Returns pointer to router with the
+ * corresponding routerID, or NULL if it does not exist.
+ */
+struct router *find_router(unsigned int routerID)
+{
+		int slot = index_lookup(routerID);
+		if (slot == INDEX_EMPTY)
+				return NULL;
+		return router_array[slot];
+}
+
+
 /*
  * Check if a router <struct router *r> is already connected
  * to router with id <unsigned int id>.
@@ -380,16 +2064,12 @@ struct router *get_router(unsigned int routerID)
  */
 int is_connected(struct router *r, unsigned int id)
 {
-		struct router *neighbour;
-		for (int i = 0; i < MAX_CONNECTIONS; i++) {
-				neighbour = r->connections[i];
-				if (neighbour) {
-						if (neighbour->routerID == id) {
-								return TRUE;
-						}
-				}
-		}
-		return FALSE;
+		struct router *neighbour = find_router(id);
+		if (!(neighbour))
+				return FALSE;
+		if (r->n_conn > NEIGHBOUR_SET_MIN_DEGREE && (r->hashed || neighbour_add_row(r) == SUCCESS))
+				return neighbour_contains(neighbour_key(r->slot, neighbour->slot));
+		return row_contains(adjacency.target + r->conn_start, r->n_conn, neighbour->slot);
 }
 
 
@@ -411,21 +2091,69 @@ int add_connection(unsigned int fromID, unsigned int toID)
 
 
 /*
- * Function finds an empty (NULL) ptr in connection array of the
- * <from> struct, and sets this to the <to>-pointer.
+ * Function appends the <to> router to the connection row of the
+ * <from> struct, and registers <from> in the reverse adjacency of <to>.
+ * A missing <to> router is ignored.
  * [A weakness with this function so far is that it does not check
  * for already existing connections between two routers, thus it can
  * create a new connection between two routers already connected.]
  */
 int set_connection(struct router *from, struct router *to)
 {
-		for(int i = 0; i < MAX_CONNECTIONS; i++) {
-				if (from && from->connections[i] == NULL) {
-						from->connections[i] = to;
-						return SUCCESS;
+		if (!(from))
+				return FAILURE;
+		if (!(to))
+				return SUCCESS;
+		if (add_incoming(to, from) != SUCCESS)
+				return FAILURE;
+		if (adjacency_append(from, to->slot) != SUCCESS) {
+				remove_incoming(to, from);
+				return FAILURE;
+		}
+		graph_epoch++;
+		snapshot_touch(from->slot, SNAPSHOT_GRAPH);
+		snapshot_touch(to->slot, SNAPSHOT_GRAPH);
+		if (adjacency.used - adjacency.live > adjacency.live + ADJ_COMPACT_MIN_HOLES)
+				adjacency_compact();
+		return SUCCESS;
+}
+
+
+/*
+ * Append <struct router *from> to the list of incoming connections of
+ * <struct router *to>. The list grows by doubling.
+ * Memory is freed in remove_router() or remove_all_routers().
+ */
+int add_incoming(struct router *to, struct router *from)
+{
+		if (to->n_incoming == to->incoming_cap) {
+				int new_cap = to->incoming_cap ? to->incoming_cap * 2 : 4;
+				struct router **tmp = realloc(to->incoming, sizeof(struct router*) * new_cap);
+				if (!(tmp)) {
+						perror("Error with realloc");
+						return FAILURE;
+				}
+				to->incoming = tmp;
+				to->incoming_cap = new_cap;
+		}
+		to->incoming[to->n_incoming++] = from;
+		return SUCCESS;
+}
+
+
+/*
+ * Remove one occurrence of <struct router *from> from the list of incoming
+ * connections of <struct router *to>. Order of the list is not kept.
+ */
+void remove_incoming(struct router *to, struct router *from)
+{
+		for (int i = 0; i < to->n_incoming; i++) {
+				if (to->incoming[i] == from) {
+						to->incoming[i] = to->incoming[--to->n_incoming];
+						snapshot_touch(to->slot, SNAPSHOT_GRAPH);
+						return;
 				}
 		}
-		return FAILURE;
 }
 
 
@@ -464,8 +2192,8 @@ int set_all_connections(FILE *fh)
 						return SUCCESS;
 				}
 				/* fetch ptr to routers based on IDs */
-				/* and set connections accordingly */
-				if (set_connection(get_router(fromID), get_router(toID)) != SUCCESS)
+				/* and collect the connection for adjacency_build() */
+				if (load_connection(get_router(fromID), get_router(toID)) != SUCCESS)
 						fprintf(stderr, "\n%sError%s: Something went wrong when setting a router connection\n", CLR_RED, CLR_NRM);
 
 				/* Consume the following 0-byte, and check if next call to fgetc()
@@ -480,6 +2208,145 @@ int set_all_connections(FILE *fh)
 }
 
 
+/*
+ * Establishes all connections in the connection section of the router file,
+ * starting at <size_t pos> in <const unsigned char *buf> of <size_t size>
+ * bytes. Each record is fromID, toID and a 0-byte (9 bytes). As with
+ * set_all_connections(), unknown router IDs are ignored with a warning and
+ * an incomplete record at the end of the file is ignored.
+ * The terminating 0-byte may be missing from the last record.
+ * The records are decoded in chunks, by the worker pool if there are enough
+ * of them, and then packed in file order for adjacency_build().
+ * Returns SUCCESS, or CRITICAL_FAILURE if out of memory.
+ */
+int set_all_connections_from_buffer(const unsigned char *buf, size_t size, size_t pos)
+{
+		/* Return to main if N <= 0 (no connections to set) */
+		if (N <= 0 || pos > size)
+				return SUCCESS;
+
+		struct connection_load *load = &connection_load;
+		load->records = buf + pos;
+		load->n_records = (size - pos + 1) / CONNECTION_RECORD_SIZE;
+		if (load->n_records == 0)
+				return SUCCESS;
+		load->n_chunks = (load->n_records + LOAD_CHUNK_RECORDS - 1) / LOAD_CHUNK_RECORDS;
+		load->n_unknown = calloc(load->n_chunks, sizeof(int));
+		int *tmp_from = realloc(adjacency.load_from, sizeof(int) * load->n_records);
+		if (tmp_from)
+				adjacency.load_from = tmp_from;
+		int *tmp_to = realloc(adjacency.load_to, sizeof(int) * load->n_records);
+		if (tmp_to)
+				adjacency.load_to = tmp_to;
+		if (!(load->n_unknown) || !(tmp_from) || !(tmp_to)) {
+				perror("Error with malloc");
+				free(load->n_unknown);
+				return CRITICAL_FAILURE;
+		}
+		adjacency.load_cap = load->n_records;
+
+		atomic_store(&load->next_chunk, 0);
+		if (worker_pool.n_threads >= 2 && load->n_chunks >= 2 && pool_start() == SUCCESS)
+				pool_run(decode_connections);
+		else
+				decode_connections(NULL);
+
+		/* Pack the known connections in file order, and warn about the rest
+		 * in the same way as when the records are read one by one */
+		adjacency.n_load = 0;
+		for (int c = 0; c < load->n_chunks; c++) {
+				size_t first = (size_t) c * LOAD_CHUNK_RECORDS;
+				size_t end = first + LOAD_CHUNK_RECORDS < load->n_records ? first + LOAD_CHUNK_RECORDS : load->n_records;
+				if (load->n_unknown[c] == 0) {
+						memmove(adjacency.load_from + adjacency.n_load, adjacency.load_from + first, sizeof(int) * (end - first));
+						memmove(adjacency.load_to + adjacency.n_load, adjacency.load_to + first, sizeof(int) * (end - first));
+						adjacency.n_load += end - first;
+						continue;
+				}
+				for (size_t i = first; i < end; i++) {
+						if (adjacency.load_from[i] != INDEX_EMPTY && adjacency.load_to[i] != INDEX_EMPTY) {
+								adjacency.load_from[adjacency.n_load] = adjacency.load_from[i];
+								adjacency.load_to[adjacency.n_load] = adjacency.load_to[i];
+								adjacency.n_load++;
+								continue;
+						}
+						unsigned int fromID, toID;
+						memcpy(&fromID, load->records + i * CONNECTION_RECORD_SIZE, sizeof(unsigned int));
+						memcpy(&toID, load->records + i * CONNECTION_RECORD_SIZE + sizeof(unsigned int), sizeof(unsigned int));
+						if (load_connection(get_router(fromID), get_router(toID)) != SUCCESS)
+								fprintf(stderr, "\n%sError%s: Something went wrong when setting a router connection\n", CLR_RED, CLR_NRM);
+				}
+		}
+		free(load->n_unknown);
+		load->n_unknown = NULL;
+		return SUCCESS;
+}
+
+
+/*
+ * Takes chunks of the connection section from connection_load until there
+ * are none left, and decodes their records into router slots through the
+ * index. Run by each worker of the pool, or with <struct worker *w> NULL
+ * by the main thread alone.
+ */
+void decode_connections(struct worker *w)
+{
+		(void) w;
+		struct connection_load *load = &connection_load;
+		int c;
+		while ((c = atomic_fetch_add(&load->next_chunk, 1)) < load->n_chunks) {
+				size_t first = (size_t) c * LOAD_CHUNK_RECORDS;
+				size_t end = first + LOAD_CHUNK_RECORDS < load->n_records ? first + LOAD_CHUNK_RECORDS : load->n_records;
+				int n_unknown = 0;
+				for (size_t i = first; i < end; i++) {
+						const unsigned char *record = load->records + i * CONNECTION_RECORD_SIZE;
+						unsigned int fromID, toID;
+						memcpy(&fromID, record, sizeof(unsigned int));
+						memcpy(&toID, record + sizeof(unsigned int), sizeof(unsigned int));
+						int from_slot = index_lookup(fromID);
+						int to_slot = index_lookup(toID);
+						adjacency.load_from[i] = from_slot;
+						adjacency.load_to[i] = to_slot;
+						if (from_slot == INDEX_EMPTY || to_slot == INDEX_EMPTY)
+								n_unknown++;
+				}
+				load->n_unknown[c] = n_unknown;
+		}
+}
+
+
+/*
+ * Collects a connection read at load, from <struct router *from> to
+ * <struct router *to>, to be set in bulk by adjacency_build().
+ * As with set_connection(), a missing <to> router is ignored.
+ */
+int load_connection(struct router *from, struct router *to)
+{
+		if (!(from))
+				return FAILURE;
+		if (!(to))
+				return SUCCESS;
+		if (adjacency.n_load == adjacency.load_cap) {
+				size_t new_cap = adjacency.load_cap ? adjacency.load_cap * 2 : 1024;
+				int *tmp_from = realloc(adjacency.load_from, sizeof(int) * new_cap);
+				if (tmp_from)
+						adjacency.load_from = tmp_from;
+				int *tmp_to = realloc(adjacency.load_to, sizeof(int) * new_cap);
+				if (tmp_to)
+						adjacency.load_to = tmp_to;
+				if (!(tmp_from) || !(tmp_to)) {
+						perror("Error with realloc");
+						return FAILURE;
+				}
+				adjacency.load_cap = new_cap;
+		}
+		adjacency.load_from[adjacency.n_load] = from->slot;
+		adjacency.load_to[adjacency.n_load] = to->slot;
+		adjacency.n_load++;
+		return SUCCESS;
+}
+
+
 /*
  * Function takes current flag <unsigned char> and masks the value
  * (bitwise or) of bit position <unsigned char bit_pos> so that
@@ -571,20 +2438,25 @@ int set_flag(unsigned int routerID, unsigned char bit_pos, unsigned char val)
 				print_invalid_bit_pos(bit_pos, routerID);
 				return FAILURE;
 		}
+		snapshot_touch(r->slot, SNAPSHOT_GRAPH);
 		return SUCCESS;
 }
 
 
 /*
  * Sets the producer/model string of router given by <unsigned int routerID>
- * to the string given by char *new_name.
+ * to the <int len> characters at <const char *new_name> (not 0-terminated),
+ * cut to DESC_MAX_LEN characters.
  */
-int set_model(unsigned int routerID, char *new_name)
+int set_model(unsigned int routerID, const char *new_name, int len)
 {
 		struct router *r = get_router(routerID);
-		int str_len = strlen(new_name);
-		strncpy(r->description, new_name, DESC_MAX_LEN);
-		r->desc_len = str_len;
+		struct router_desc *d = &desc_store[r->slot];
+		if (len > DESC_MAX_LEN)
+				len = DESC_MAX_LEN;
+		memcpy(d->description, new_name, len);
+		d->desc_len = len;
+		snapshot_touch(r->slot, SNAPSHOT_DESC);
 		return SUCCESS;
 }
 
@@ -592,55 +2464,58 @@ int set_model(unsigned int routerID, char *new_name)
 /*
  * Remove router given by <unsigned int routerID> from network.
  * First the function removes any connections from other routers
- * to the given router.
- * Then it frees all allocated memory in struct of router,
+ * to the given router, visiting only the routers in its incoming list.
+ * Then it removes the router from the incoming lists of its neighbours,
+ * and frees all allocated memory in struct of router,
  * before freeing the struct itself.
  */
 int remove_router(unsigned int routerID)
 {
 		/* Check if router actually exists */
-		if (!(get_router(routerID))) {
+		int slot = index_lookup(routerID);
+		if (slot == INDEX_EMPTY) {
 				fprintf(stderr, "%sError%s: no router with ID %d\n", CLR_RED, CLR_NRM, routerID);
 				return FAILURE;
 		}
 
-		/* Iterate through all routers and look for connection */
-		/* If found, set to NULL */
-		struct router *searched_router, *other_router;
-		for(int i = 0; i < N; i++) {
-				other_router = router_array[i];
-				if (other_router) {
-						for (int j = 0; j < MAX_CONNECTIONS; j++) {
-								searched_router = other_router->connections[j];
-								if (searched_router && searched_router->routerID == routerID) {
-										/* printf("Removing %d from connections of %d\n", searched_router->routerID, other_router->routerID);  /\* DEBUG *\/ */
-										other_router->connections[j] = NULL;
-								}
-						}
-				}
+		/* Iterate through the routers connected to this router */
+		/* and remove their connections to it */
+		struct router *r = router_array[slot];
+		struct router *other_router;
+		for (int i = 0; i < r->n_incoming; i++)
+				adjacency_remove(r->incoming[i], slot);
+
+		/* Remove this router from incoming lists of routers it connects to */
+		int *conn = adjacency.target + r->conn_start;
+		for (int j = 0; j < r->n_conn; j++) {
+				other_router = router_array[conn[j]];
+				if (other_router != r)
+						remove_incoming(other_router, r);
 		}
+		adjacency_drop_row(r);
 
 		/* Careful with order.
-		 * Get copy of the pointer to given router struct.
-		 * Set pointer in global router array to NULL.
+		 * Set pointer in global router array to NULL and remove it from index.
 		 * Free router struct pointed to by copied pointer. */
-		struct router *r = get_router(routerID);
-		for(int i = 0; i < N; i++) {
-				if (router_array[i] && router_array[i]->routerID == routerID) {
-						router_array[i] = NULL;
-				}
-		}
-		free(r);
+		router_array[slot] = NULL;
+		index_remove(routerID);
+		graph_epoch++;
+		snapshot_touch(slot, SNAPSHOT_GRAPH);
+		free(r->incoming);
+		arena_release(r);
 		/* Decrement count of actual routers */
 		N_ROUTERS -= 1;
+		if (adjacency.used - adjacency.live > adjacency.live + ADJ_COMPACT_MIN_HOLES)
+				adjacency_compact();
 		return SUCCESS;
 }
 
 
 /*
- * Iterates through global router_array and calls
- * remove_router(<unsigned int routerID>) for each router,
- * to remove it from list and free allocated memory.
+ * Iterates through global router_array once, freeing the incoming lists,
+ * and then releases all router structs at once through the arena.
+ * Since all routers are removed, no connections have to be unlinked.
+ * Index entries are left as is; the index is freed separately in index_free().
  */
 void remove_all_routers()
 {
@@ -648,334 +2523,4336 @@ void remove_all_routers()
 		for (int i = 0; i < N; i++) {
 				r = router_array[i];
 				if (r) {
-						remove_router(r->routerID);
+						free(r->incoming);
+						router_array[i] = NULL;
 				}
 		}
+		arena_free_all();
+		N_ROUTERS = 0;
 }
 
 
 
-/* --- COMMANDS FUNCTIONS ---  */
-/* Functions for interacting with commands in 'kommando-fil' */
+/* --- ROUTER ARENA FUNCTIONS --- */
 
 /*
- * Parses the line given as argument from the func 'run_all_commands',
- * initializes the relevant variables according to the command,
- * and calls the corresponding function for each command.
- * Does a lot of error checking. Returns FAILURE if command not run successfully,
- * which results in early termination of program in main (to avoid an invalid write
- * to router file).
+ * Returns an uninitialized router struct from the arena. Reuses a released
+ * router if there is one, and otherwise takes the next router of the newest
+ * chunk, allocating a new chunk when it is full.
+ * Returns NULL on allocation failure.
  */
-int run_command(char line[])
+struct router *arena_alloc()
 {
-		/* Parse line */
-		char *command;
-		unsigned int routerID;
-		unsigned char flag;
-		unsigned char val;
-		char *desc;
-		unsigned int fromID;
-		unsigned int toID;
+		struct router *r = router_arena.free_list;
+		if (r) {
+				router_arena.free_list = r->next_free;
+				return r;
+		}
+
+		struct router_chunk *chunk = router_arena.chunks;
+		if (!(chunk) || chunk->used == ARENA_CHUNK_ROUTERS) {
+				chunk = malloc(sizeof(struct router_chunk) + sizeof(struct router) * ARENA_CHUNK_ROUTERS);
+				if (!(chunk)) {
+						perror("Error with malloc");
+						return NULL;
+				}
+				chunk->next = router_arena.chunks;
+				chunk->used = 0;
+				router_arena.chunks = chunk;
+				router_arena.n_chunks++;
+		}
+		return &chunk->routers[chunk->used++];
+}
+
+
+/* Returns router struct <struct router *r> to the arena's free list */
+void arena_release(struct router *r)
+{
+		r->next_free = router_arena.free_list;
+		router_arena.free_list = r;
+}
+
+
+/* Frees all chunks of the arena, and with them every router struct */
+void arena_free_all()
+{
+		struct router_chunk *chunk = router_arena.chunks;
+		while (chunk) {
+				struct router_chunk *next = chunk->next;
+				free(chunk);
+				chunk = next;
+		}
+		router_arena.chunks = NULL;
+		router_arena.free_list = NULL;
+		router_arena.n_chunks = 0;
+}
+
+
+
+/* --- ADJACENCY FUNCTIONS --- */
+
+/*
+ * Turns the connections collected by load_connection() into rows, with a
+ * counting sort that keeps the order of the file within each row.
+ * The incoming lists are filled in the same way, with exact capacity.
+ * With enough connections the counting and filling are shared out over
+ * the worker pool by build_rows().
+ * Returns FAILURE (after printing an error) on allocation failure.
+ */
+int adjacency_build()
+{
+		size_t n = adjacency.n_load;
+		int parallel = worker_pool.n_threads >= 2 && n >= 2 * LOAD_CHUNK_RECORDS && pool_start() == SUCCESS;
+		int n_parts = parallel ? worker_pool.n_threads : 1;
+		size_t n_counts = (size_t) n_parts * (N > 0 ? N : 1);
+		int *out_degree = calloc(n_counts, sizeof(int));
+		int *in_degree = calloc(n_counts, sizeof(int));
+		if (!(out_degree) || !(in_degree) || adjacency_reserve(adjacency.used + n) != SUCCESS) {
+				if (!(out_degree) || !(in_degree))
+						perror("Error with calloc");
+				free(out_degree);
+				free(in_degree);
+				return FAILURE;
+		}
+		connection_load.n_parts = n_parts;
+		connection_load.out_degree = out_degree;
+		connection_load.in_degree = in_degree;
+
+		connection_load.pass = 1;
+		if (parallel)
+				pool_run(build_rows);
+		else
+				build_rows(NULL);
+
+		/*
+		 * Lay out rows back to back, and size the incoming lists. The counts
+		 * of each part become its offset in the row and incoming list, after
+		 * the connections of the parts before it.
+		 */
+		int result = SUCCESS;
+		struct router *r;
+		for (int i = 0; i < N && result == SUCCESS; i++) {
+				r = router_array[i];
+				if (!(r))
+						continue;
+				int n_out = 0;
+				int n_in = 0;
+				for (int p = 0; p < n_parts; p++) {
+						size_t k = (size_t) p * N + i;
+						int count = out_degree[k];
+						out_degree[k] = n_out;
+						n_out += count;
+						count = in_degree[k];
+						in_degree[k] = n_in;
+						n_in += count;
+				}
+				r->conn_start = adjacency.used;
+				r->conn_room = n_out;
+				r->n_conn = n_out;
+				adjacency.used += n_out;
+				if (n_in > 0) {
+						r->incoming = malloc(sizeof(struct router*) * n_in);
+						if (!(r->incoming)) {
+								perror("Error with malloc");
+								result = FAILURE;
+								continue;
+						}
+						r->incoming_cap = n_in;
+						r->n_incoming = n_in;
+				}
+		}
+
+		if (result == SUCCESS) {
+				connection_load.pass = 2;
+				if (parallel)
+						pool_run(build_rows);
+				else
+						build_rows(NULL);
+				adjacency.live += n;
+		}
+		free(out_degree);
+		free(in_degree);
+		connection_load.out_degree = NULL;
+		connection_load.in_degree = NULL;
+		if (result != SUCCESS)
+				return FAILURE;
+
+		free(adjacency.load_from);
+		free(adjacency.load_to);
+		adjacency.load_from = NULL;
+		adjacency.load_to = NULL;
+		adjacency.n_load = 0;
+		adjacency.load_cap = 0;
+		graph_epoch++;
+		return SUCCESS;
+}
+
+
+/*
+ * Runs pass connection_load.pass of adjacency_build() for the part of the
+ * collected connections owned by worker <struct worker *w>, or for all of
+ * them if w is NULL. Each worker reads only its own part, and keeps its
+ * counts in its own row of the degree arrays. Pass 1 counts the connections
+ * and incoming of each router in the part. Pass 2, with the counts turned
+ * into offsets, fills the part's connections into the rows and incoming
+ * lists, where no other part writes.
+ */
+void build_rows(struct worker *w)
+{
+		int part = w ? w->id : 0;
+		int n_parts = connection_load.n_parts;
+		size_t n = adjacency.n_load;
+		size_t first = n * part / n_parts;
+		size_t end = n * (part + 1) / n_parts;
+		int *out_degree = connection_load.out_degree + (size_t) part * N;
+		int *in_degree = connection_load.in_degree + (size_t) part * N;
+		int *load_from = adjacency.load_from;
+		int *load_to = adjacency.load_to;
+
+		if (connection_load.pass == 1) {
+				for (size_t e = first; e < end; e++) {
+						out_degree[load_from[e]]++;
+						in_degree[load_to[e]]++;
+				}
+				return;
+		}
+
+		for (size_t e = first; e < end; e++) {
+				struct router *from = router_array[load_from[e]];
+				struct router *to = router_array[load_to[e]];
+				adjacency.target[from->conn_start + out_degree[load_from[e]]++] = load_to[e];
+				to->incoming[in_degree[load_to[e]]++] = from;
+		}
+}
+
+
+/*
+ * Makes room for <size_t capacity> entries in adjacency.target, growing by
+ * doubling. Returns FAILURE (after printing an error) if realloc fails.
+ */
+int adjacency_reserve(size_t capacity)
+{
+		if (capacity <= adjacency.capacity)
+				return SUCCESS;
+		size_t new_cap = adjacency.capacity ? adjacency.capacity : 1024;
+		while (new_cap < capacity)
+				new_cap *= 2;
+		int *tmp = realloc(adjacency.target, sizeof(int) * new_cap);
+		if (!(tmp)) {
+				perror("Error with realloc");
+				return FAILURE;
+		}
+		adjacency.target = tmp;
+		adjacency.capacity = new_cap;
+		return SUCCESS;
+}
+
+
+/*
+ * Appends <int to_slot> to the connection row of <struct router *from>.
+ * A full row at the end of the adjacency grows in place; any other full
+ * row is moved to the end with twice the room.
+ * Returns FAILURE if the adjacency could not grow.
+ */
+int adjacency_append(struct router *from, int to_slot)
+{
+		if (from->n_conn == from->conn_room) {
+				int room = from->conn_room ? from->conn_room * 2 : ADJ_MIN_ROOM;
+				if (from->conn_start + from->conn_room == adjacency.used && from->conn_room > 0) {
+						if (adjacency_reserve(from->conn_start + room) != SUCCESS)
+								return FAILURE;
+						adjacency.used = from->conn_start + room;
+				} else {
+						if (adjacency_reserve(adjacency.used + room) != SUCCESS)
+								return FAILURE;
+						memcpy(adjacency.target + adjacency.used, adjacency.target + from->conn_start, sizeof(int) * from->n_conn);
+						from->conn_start = adjacency.used;
+						adjacency.used += room;
+				}
+				from->conn_room = room;
+		}
+		/* Without room in the neighbour set, the row goes back to being scanned */
+		if (from->hashed) {
+				if (neighbour_reserve(adjacency.neighbours.count + 1) == SUCCESS)
+						neighbour_insert(neighbour_key(from->slot, to_slot));
+				else
+						neighbour_drop_row(from);
+		}
+		adjacency.target[from->conn_start + from->n_conn++] = to_slot;
+		adjacency.live++;
+		return SUCCESS;
+}
+
+
+/*
+ * Removes every connection from <struct router *from> to <int to_slot>,
+ * keeping the order of the remaining connections in the row.
+ */
+void adjacency_remove(struct router *from, int to_slot)
+{
+		int *conn = adjacency.target + from->conn_start;
+		int kept = 0;
+		for (int i = 0; i < from->n_conn; i++) {
+				if (conn[i] != to_slot)
+						conn[kept++] = conn[i];
+		}
+		adjacency.live -= from->n_conn - kept;
+		if (from->hashed && kept < from->n_conn)
+				neighbour_remove(neighbour_key(from->slot, to_slot));
+		from->n_conn = kept;
+		snapshot_touch(from->slot, SNAPSHOT_GRAPH);
+}
+
+
+/* Empties the row of <struct router *r>, leaving its entries as holes */
+void adjacency_drop_row(struct router *r)
+{
+		neighbour_drop_row(r);
+		adjacency.live -= r->n_conn;
+		r->n_conn = 0;
+		r->conn_room = 0;
+		r->conn_start = 0;
+}
+
+
+/*
+ * Packs the rows of all routers back to back in a new array, in slot
+ * order and without room to spare, and frees the old array.
+ * Returns FAILURE (after printing an error, leaving the rows as they
+ * were) if the new array could not be allocated.
+ */
+int adjacency_compact()
+{
+		size_t capacity = adjacency.live > 0 ? adjacency.live : 1;
+		int *target = malloc(sizeof(int) * capacity);
+		if (!(target)) {
+				perror("Error with malloc");
+				return FAILURE;
+		}
+
+		size_t used = 0;
+		struct router *r;
+		for (int i = 0; i < N; i++) {
+				r = router_array[i];
+				if (!(r))
+						continue;
+				memcpy(target + used, adjacency.target + r->conn_start, sizeof(int) * r->n_conn);
+				r->conn_start = used;
+				r->conn_room = r->n_conn;
+				used += r->n_conn;
+		}
+		free(adjacency.target);
+		adjacency.target = target;
+		adjacency.used = used;
+		adjacency.capacity = capacity;
+		return SUCCESS;
+}
+
+
+/* Frees the adjacency, including connections collected but never built */
+void adjacency_free()
+{
+		free(adjacency.target);
+		free(adjacency.load_from);
+		free(adjacency.load_to);
+		free(adjacency.neighbours.keys);
+		memset(&adjacency, 0, sizeof(adjacency));
+}
+
+
+/*
+ * Returns TRUE if <int slot> is one of the <int n> slots at <const int *conn>.
+ * Compares eight slots at a time with AVX2 and four with SSE2 when the
+ * compiler targets them (SSE2 always on x86-64), the rest one by one.
+ */
+int row_contains(const int *conn, int n, int slot)
+{
+		int i = 0;
+#if defined(__AVX2__)
+		__m256i key8 = _mm256_set1_epi32(slot);
+		for (; i + 8 <= n; i += 8) {
+				__m256i v = _mm256_loadu_si256((const __m256i *) (conn + i));
+				if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, key8)))
+						return TRUE;
+		}
+#endif
+#if defined(__SSE2__)
+		__m128i key4 = _mm_set1_epi32(slot);
+		for (; i + 4 <= n; i += 4) {
+				__m128i v = _mm_loadu_si128((const __m128i *) (conn + i));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, key4)))
+						return TRUE;
+		}
+#endif
+		for (; i < n; i++) {
+				if (conn[i] == slot)
+						return TRUE;
+		}
+		return FALSE;
+}
+
+
+
+/* --- NEIGHBOUR SET FUNCTIONS --- */
+
+/* Key of the connection from <int from_slot> to <int to_slot> in the neighbour set */
+uint64_t neighbour_key(int from_slot, int to_slot)
+{
+		return (uint64_t) (unsigned int) from_slot << 32 | (unsigned int) to_slot;
+}
+
+
+/* Multiplicative hash of <uint64_t key>, giving a bucket in the neighbour set */
+unsigned int neighbour_hash(uint64_t key)
+{
+		return (unsigned int) ((key * NEIGHBOUR_HASH_MUL) >> adjacency.neighbours.shift);
+}
+
+
+/*
+ * Make sure the neighbour set has room for <unsigned int count> keys at a
+ * load factor of at most 0.5, rehashing into a table twice the size if not.
+ * Returns FAILURE (after printing an error, leaving the set as it was) if
+ * the new table could not be allocated.
+ */
+int neighbour_reserve(unsigned int count)
+{
+		struct neighbour_set *set = &adjacency.neighbours;
+		if (count * 2 <= set->capacity)
+				return SUCCESS;
+
+		unsigned int capacity = 64;
+		unsigned int bits = 6;
+		while (capacity < count * 2) {
+				capacity <<= 1;
+				bits++;
+		}
+		uint64_t *keys = malloc(sizeof(uint64_t) * capacity);
+		if (!(keys)) {
+				perror("Error with malloc");
+				return FAILURE;
+		}
+		for (unsigned int i = 0; i < capacity; i++)
+				keys[i] = NEIGHBOUR_EMPTY;
+
+		uint64_t *old = set->keys;
+		unsigned int old_capacity = set->capacity;
+		set->keys = keys;
+		set->capacity = capacity;
+		set->shift = 64 - bits;
+		set->count = 0;
+		for (unsigned int i = 0; i < old_capacity; i++)
+				if (old[i] != NEIGHBOUR_EMPTY)
+						neighbour_insert(old[i]);
+		free(old);
+		return SUCCESS;
+}
+
+
+/*
+ * Add <uint64_t key> to the neighbour set, unless it is there already.
+ * The caller makes room with neighbour_reserve() first.
+ */
+void neighbour_insert(uint64_t key)
+{
+		struct neighbour_set *set = &adjacency.neighbours;
+		unsigned int mask = set->capacity - 1;
+		unsigned int i = neighbour_hash(key);
+		while (set->keys[i] != NEIGHBOUR_EMPTY) {
+				if (set->keys[i] == key)
+						return;
+				i = (i + 1) & mask;
+		}
+		set->keys[i] = key;
+		set->count++;
+}
+
+
+/* Returns TRUE if <uint64_t key> is in the neighbour set */
+int neighbour_contains(uint64_t key)
+{
+		struct neighbour_set *set = &adjacency.neighbours;
+		unsigned int mask = set->capacity - 1;
+		unsigned int i = neighbour_hash(key);
+		while (set->keys[i] != NEIGHBOUR_EMPTY) {
+				if (set->keys[i] == key)
+						return TRUE;
+				i = (i + 1) & mask;
+		}
+		return FALSE;
+}
+
+
+/* Remove <uint64_t key> from the neighbour set, by backward shift deletion like index_remove() */
+void neighbour_remove(uint64_t key)
+{
+		struct neighbour_set *set = &adjacency.neighbours;
+		unsigned int mask = set->capacity - 1;
+		unsigned int i = neighbour_hash(key);
+		while (set->keys[i] != NEIGHBOUR_EMPTY && set->keys[i] != key)
+				i = (i + 1) & mask;
+		if (set->keys[i] == NEIGHBOUR_EMPTY)
+				return;
+
+		unsigned int hole = i;
+		unsigned int j = i;
+		while (TRUE) {
+				j = (j + 1) & mask;
+				if (set->keys[j] == NEIGHBOUR_EMPTY)
+						break;
+				unsigned int home = neighbour_hash(set->keys[j]);
+				if (((j - home) & mask) >= ((j - hole) & mask)) {
+						set->keys[hole] = set->keys[j];
+						hole = j;
+				}
+		}
+		set->keys[hole] = NEIGHBOUR_EMPTY;
+		set->count--;
+}
+
+
+/*
+ * Add the connections of <struct router *r> to the neighbour set, which
+ * keeps them up to date from then on.
+ * Returns SUCCESS, or FAILURE (after printing an error) if out of memory.
+ */
+int neighbour_add_row(struct router *r)
+{
+		if (neighbour_reserve(adjacency.neighbours.count + r->n_conn) != SUCCESS)
+				return FAILURE;
+		int *conn = adjacency.target + r->conn_start;
+		for (int i = 0; i < r->n_conn; i++)
+				neighbour_insert(neighbour_key(r->slot, conn[i]));
+		r->hashed = TRUE;
+		return SUCCESS;
+}
+
+
+/* Remove the connections of <struct router *r> from the neighbour set, if they are in it */
+void neighbour_drop_row(struct router *r)
+{
+		if (!(r->hashed))
+				return;
+		int *conn = adjacency.target + r->conn_start;
+		for (int i = 0; i < r->n_conn; i++)
+				neighbour_remove(neighbour_key(r->slot, conn[i]));
+		r->hashed = FALSE;
+}
+
+
+
+/* --- ROUTER INDEX FUNCTIONS --- */
+
+/*
+ * Allocate the global router index with room for <unsigned int num_routers>.
+ * Capacity is rounded up to a power of two giving a load factor of at most 0.5.
+ * Memory is freed in index_free().
+ */
+int index_init(unsigned int num_routers)
+{
+		unsigned int capacity = 16;
+		unsigned int bits = 4;
+		while (capacity < num_routers * 2) {
+				capacity <<= 1;
+				bits++;
+		}
+
+		router_index.keys = malloc(sizeof(unsigned int) * capacity);
+		router_index.slots = malloc(sizeof(int) * capacity);
+		if (!(router_index.keys) || !(router_index.slots)) {
+				perror("Error with malloc");
+				index_free();
+				return FAILURE;
+		}
+		for (unsigned int i = 0; i < capacity; i++)
+				router_index.slots[i] = INDEX_EMPTY;
+
+		router_index.capacity = capacity;
+		router_index.count = 0;
+		router_index.shift = 32 - bits;
+		return SUCCESS;
+}
+
+
+/* Multiplicative hash of <unsigned int routerID>, giving a bucket in the index */
+unsigned int index_hash(unsigned int routerID)
+{
+		return (unsigned int) (routerID * INDEX_HASH_MUL) >> router_index.shift;
+}
+
+
+/*
+ * Register router with <unsigned int routerID> at <int slot> in router_array.
+ * Returns FAILURE (and keeps the first entry) if the ID is already indexed.
+ */
+int index_insert(unsigned int routerID, int slot)
+{
+		unsigned int mask = router_index.capacity - 1;
+		unsigned int i = index_hash(routerID);
+		while (router_index.slots[i] != INDEX_EMPTY) {
+				if (router_index.keys[i] == routerID) {
+						fprintf(stderr, "%sWarning%s: duplicate router id %u in file. Ignoring.\n", CLR_RED, CLR_NRM, routerID);
+						return FAILURE;
+				}
+				i = (i + 1) & mask;
+		}
+		router_index.keys[i] = routerID;
+		router_index.slots[i] = slot;
+		router_index.count++;
+		return SUCCESS;
+}
+
+
+/*
+ * Returns slot in router_array for router with <unsigned int routerID>,
+ * or INDEX_EMPTY if no such router is indexed.
+ */
+int index_lookup(unsigned int routerID)
+{
+		unsigned int mask = router_index.capacity - 1;
+		unsigned int i = index_hash(routerID);
+		while (router_index.slots[i] != INDEX_EMPTY) {
+				if (router_index.keys[i] == routerID)
+						return router_index.slots[i];
+				i = (i + 1) & mask;
+		}
+		return INDEX_EMPTY;
+}
+
+
+/*
+ * Remove <unsigned int routerID> from the index.
+ * Uses backward shift deletion, so no tombstones are left behind and
+ * lookups never have to probe past deleted entries.
+ */
+void index_remove(unsigned int routerID)
+{
+		unsigned int mask = router_index.capacity - 1;
+		unsigned int i = index_hash(routerID);
+		while (router_index.slots[i] != INDEX_EMPTY && router_index.keys[i] != routerID)
+				i = (i + 1) & mask;
+		if (router_index.slots[i] == INDEX_EMPTY)
+				return;
+
+		/* Move later entries of the probe sequence into the hole when allowed */
+		unsigned int hole = i;
+		unsigned int j = i;
+		while (TRUE) {
+				j = (j + 1) & mask;
+				if (router_index.slots[j] == INDEX_EMPTY)
+						break;
+				unsigned int home = index_hash(router_index.keys[j]);
+				/* Entry at j may only move if its home bucket is not in (hole, j] */
+				if (((j - home) & mask) >= ((j - hole) & mask)) {
+						router_index.keys[hole] = router_index.keys[j];
+						router_index.slots[hole] = router_index.slots[j];
+						hole = j;
+				}
+		}
+		router_index.slots[hole] = INDEX_EMPTY;
+		router_index.count--;
+}
+
+
+/* Free memory allocated to the global router index in index_init() */
+void index_free()
+{
+		free(router_index.keys);
+		free(router_index.slots);
+		router_index.keys = NULL;
+		router_index.slots = NULL;
+		router_index.capacity = 0;
+		router_index.count = 0;
+}
+
+
+/* --- COMMANDS FUNCTIONS ---  */
+/* Functions for interacting with commands in 'kommando-fil' */
+
+/*
+ * Returns the command with the keyword of <int len> characters at
+ * <const char *word>, or CMD_INVALID. The length and first character
+ * single out the candidate, so at most one memcmp() is done.
+ */
+enum command_kind command_keyword(const char *word, int len)
+{
+		switch (len) {
+		case 5:
+				return memcmp(word, "print", 5) == 0 ? CMD_PRINT : CMD_INVALID;
+		case 9:
+				return memcmp(word, "sett_flag", 9) == 0 ? CMD_SETT_FLAG : CMD_INVALID;
+		case 10:
+				return memcmp(word, "scc_indeks", 10) == 0 ? CMD_SCC_INDEKS : CMD_INVALID;
+		case 11:
+				if (word[0] == 'f')
+						return memcmp(word, "finnes_rute", 11) == 0 ? CMD_FINNES_RUTE : CMD_INVALID;
+				return memcmp(word, "sett_modell", 11) == 0 ? CMD_SETT_MODELL : CMD_INVALID;
+		case 12:
+				return memcmp(word, "slett_router", 12) == 0 ? CMD_SLETT_ROUTER : CMD_INVALID;
+		case 16:
+				return memcmp(word, "legg_til_kobling", 16) == 0 ? CMD_LEGG_TIL_KOBLING : CMD_INVALID;
+		}
+		return CMD_INVALID;
+}
+
+
+/*
+ * Parses the next space separated number between <const char *p> and
+ * <const char *end> into <unsigned int *number>. Like atoi(), a sign is
+ * allowed and anything after the digits of the token is ignored.
+ * Returns a pointer past the token, or NULL if there is no token.
+ */
+const char *parse_number(const char *p, const char *end, unsigned int *number)
+{
+		while (p < end && *p == ' ')
+				p++;
+		if (p == end)
+				return NULL;
+
+		int negative = *p == '-';
+		if (*p == '-' || *p == '+')
+				p++;
+		unsigned int value = 0;
+		while (p < end && (unsigned char) (*p - '0') < 10)
+				value = value * 10 + (*p++ - '0');
+		while (p < end && *p != ' ')
+				p++;
+		*number = negative ? -value : value;
+		return p;
+}
+
+
+/*
+ * Parses the command line of <size_t len> characters at <const char *line>
+ * (without newline) into <struct command *cmd>, in one pass and without
+ * copying. Tokens are separated by spaces. The description of 'sett_modell'
+ * is the rest of the line after the space following the routerID.
+ */
+void parse_command(const char *line, size_t len, struct command *cmd)
+{
+		const char *end = line + len;
+		const char *p = line;
+		while (p < end && *p == ' ')
+				p++;
+		cmd->keyword = p;
+		while (p < end && *p != ' ')
+				p++;
+		cmd->keyword_len = p - cmd->keyword;
+		cmd->kind = command_keyword(cmd->keyword, cmd->keyword_len);
+		cmd->n_args = 0;
+		cmd->text = NULL;
+		cmd->text_len = 0;
+
+		int wanted;
+		switch (cmd->kind) {
+		case CMD_SETT_FLAG: wanted = 3; break;
+		case CMD_LEGG_TIL_KOBLING:
+		case CMD_FINNES_RUTE: wanted = 2; break;
+		case CMD_SCC_INDEKS:
+		case CMD_INVALID: wanted = 0; break;
+		default: wanted = 1;
+		}
+		while (cmd->n_args < wanted) {
+				const char *next = parse_number(p, end, &cmd->args[cmd->n_args]);
+				if (!(next))
+						return;
+				p = next;
+				cmd->n_args++;
+		}
+
+		if (cmd->kind == CMD_SETT_MODELL && p < end) {
+				cmd->text = p + 1;
+				cmd->text_len = end - cmd->text;
+		} else if (cmd->kind == CMD_SCC_INDEKS) {
+				while (p < end && *p == ' ')
+						p++;
+				cmd->text = p;
+				while (p < end && *p != ' ')
+						p++;
+				cmd->text_len = p - cmd->text;
+				if (cmd->text_len == 0)
+						cmd->text = NULL;
+		}
+}
+
+
+/*
+ * Runs the command parsed into <struct command *cmd>.
+ * Does a lot of error checking. Returns FAILURE if command not run successfully,
+ * and CRITICAL_FAILURE if the keyword is not a command, which results in
+ * early termination of program in main (to avoid an invalid write
+ * to router file).
+ */
+int execute_command(struct command *cmd)
+{
+		unsigned int routerID = cmd->args[0];
+		unsigned int fromID = cmd->args[0];
+		unsigned int toID = cmd->args[1];
+		unsigned char flag;
+		unsigned char val;
+		struct router *r;
 		int succeeded = SUCCESS;
 
-		command = strtok(line, " ");
-		/* Check if token is NULL*/
+		if (cmd->kind == CMD_INVALID) {
+				fprintf(stderr, "%sWarning:%s '%.*s' is not a valid command\n", CLR_RED, CLR_NRM, cmd->keyword_len, cmd->keyword);
+				fprintf(stderr, "Check for a possible empty line in commands-file\n");
+				return CRITICAL_FAILURE;
+		}
+		if ((cmd->kind == CMD_SETT_FLAG && cmd->n_args < 3)
+			|| ((cmd->kind == CMD_LEGG_TIL_KOBLING || cmd->kind == CMD_FINNES_RUTE) && cmd->n_args < 2)
+			|| (cmd->kind != CMD_SCC_INDEKS && cmd->n_args < 1)
+			|| (cmd->kind == CMD_SETT_MODELL && !(cmd->text))) {
+				print_missing_arguments(cmd);
+				return FAILURE;
+		}
+
+		switch (cmd->kind) {
+		case CMD_PRINT:
+				r = find_router(routerID);
+				if (!(r)) {
+						print_unknown_router(stdout, CMD_PRINT, routerID);
+						succeeded = FAILURE;
+				} else {
+						print_router_info(stdout, NULL, r->slot);
+				}
+				break;
+
+		case CMD_SETT_FLAG:
+				flag = cmd->args[1];
+				val = cmd->args[2];
+				if (!(find_router(routerID))) {
+						print_invalid_routerID(routerID);
+						succeeded = FAILURE;
+				} else {
+						/* printf("\nSetting flag – router: %d, flag: 0x%x, changing to: 0x%x\n", routerID, flag, val); */
+						succeeded = set_flag(routerID, flag, val);
+						if (succeeded == SUCCESS)
+								journal_record_flag(find_router(routerID));
+				}
+				break;
+
+		case CMD_SETT_MODELL:
+				if (!(find_router(routerID))) {
+						print_invalid_routerID(routerID);
+						succeeded = FAILURE;
+				} else {
+						/* printf("\nSetting model – id: %d, new description: %.*s\n", routerID, cmd->text_len, cmd->text); */
+						succeeded = set_model(routerID, cmd->text, cmd->text_len);
+						if (succeeded == SUCCESS)
+								journal_record_model(find_router(routerID));
+				}
+				break;
+
+		case CMD_LEGG_TIL_KOBLING:
+				if (!(find_router(fromID))) {
+						print_invalid_routerID(fromID);
+						succeeded = FAILURE;
+				} else if (!(find_router(toID))) {
+						print_invalid_routerID(toID);
+						succeeded = FAILURE;
+				} else {
+						/* printf("\nAdding connection – from %d to %d\n", fromID, toID); */
+						succeeded = add_connection(fromID, toID);
+						if (succeeded == SUCCESS)
+								journal_record_connection(fromID, toID);
+				}
+				break;
+
+		case CMD_SLETT_ROUTER:
+				if (!(find_router(routerID))) {
+						print_invalid_routerID(routerID);
+						succeeded = FAILURE;
+				} else {
+						/* printf("\nRemoving – router with id: %d\n", routerID); */
+						succeeded = remove_router(routerID);
+						if (succeeded == SUCCESS)
+								journal_record_remove(routerID);
+				}
+				break;
+
+		case CMD_SCC_INDEKS:
+				if (cmd->text && cmd->text_len == 4 && memcmp(cmd->text, "bygg", 4) == 0) {
+						scc_index.enabled = TRUE;
+						succeeded = scc_build();
+						scc_print_status();
+				} else if (cmd->text && cmd->text_len == 6 && memcmp(cmd->text, "status", 6) == 0) {
+						scc_print_status();
+				} else {
+						fprintf(stderr, "%sWarning%s: 'scc_indeks' expects 'bygg' or 'status'\n", CLR_RED, CLR_NRM);
+						succeeded = FAILURE;
+				}
+				break;
+
+		case CMD_FINNES_RUTE:
+				if (!(find_router(fromID))) {
+						print_unknown_router(stdout, CMD_FINNES_RUTE, fromID);
+						succeeded = FAILURE;
+				} else if (!(find_router(toID))) {
+						print_unknown_router(stdout, CMD_FINNES_RUTE, toID);
+						succeeded = FAILURE;
+				} else {
+						/* printf("\nLooking for a path – from %d to %d\n", fromID, toID); */
+						succeeded = exists_path(fromID, toID);
+				}
+				break;
+
+		case CMD_INVALID:
+				break;
+		}
+
+		if (!(succeeded == 0)) {
+				/* fprintf(stderr, "%sWarning:%s something went wrong during execution of a command.\n", CLR_RED, CLR_NRM); */
+				return FAILURE;
+		}
+
+		return SUCCESS;
+}
+
+
+/*
+ * Parses and runs the command line of <size_t len> characters at
+ * <const char *line> (without newline).
+ * Returns as execute_command().
+ */
+int run_command(const char *line, size_t len)
+{
+		struct command cmd;
+		parse_command(line, len, &cmd);
+		return execute_command(&cmd);
+}
+
+
+/*
+ * Returns the contents of the commands-file <FILE *fh>, and sets <size_t *size>.
+ * Regular files are memory mapped (<int *mapped> is set to TRUE); other
+ * files (pipes, devices) are read into allocated memory.
+ * Returns NULL if the file is empty or could not be read; *size is then 0
+ * for an empty file.
+ */
+char *map_command_file(FILE *fh, size_t *size, int *mapped)
+{
+		struct stat st;
+		*size = 0;
+		*mapped = FALSE;
+		if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+				char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+				if (buf != MAP_FAILED) {
+						madvise(buf, st.st_size, MADV_SEQUENTIAL);
+						*size = st.st_size;
+						*mapped = TRUE;
+						return buf;
+				}
+		}
+
+		size_t capacity = 0;
+		char *buf = NULL;
+		do {
+				if (*size == capacity) {
+						capacity = capacity ? capacity * 2 : 65536;
+						char *tmp = realloc(buf, capacity);
+						if (!(tmp)) {
+								perror("Error with realloc");
+								free(buf);
+								*size = 1;
+								return NULL;
+						}
+						buf = tmp;
+				}
+				*size += fread(buf + *size, 1, capacity - *size, fh);
+		} while (!(feof(fh)) && !(ferror(fh)));
+		if (error_flag_file(fh, "run_all_commands") || *size == 0) {
+				free(buf);
+				return NULL;
+		}
+		return buf;
+}
+
+
+/*
+ * Executes all commands found in file given as argument <FILE *fh>.
+ * A regular file is mapped (or read) at once and run by run_command_buffer();
+ * pipes, FIFOs and terminals are run by run_command_stream() as the
+ * commands arrive.
+ * Returns FAILURE if the file is empty, CRITICAL_FAILURE if it could not be
+ * read or a command was invalid, SUCCESS otherwise.
+ */
+int run_all_commands(FILE *fh)
+{
+		struct stat st;
+		if (fstat(fileno(fh), &st) == 0 && !(S_ISREG(st.st_mode)))
+				return run_command_stream(fh);
+
+		size_t size;
+		int mapped;
+		char *buf = map_command_file(fh, &size, &mapped);
+		/* Check if file is empty, or if error on read */
+		if (!(buf)) {
+				if (size == 0 && !(ferror(fh))) {
+						fprintf(stderr, "%sWarning%s: Commands-file is empty.\n", CLR_RED, CLR_NRM);
+						return FAILURE;
+				}
+				return CRITICAL_FAILURE;
+		}
+
+		int result = run_command_buffer(buf, size);
+		if (mapped)
+				munmap(buf, size);
+		else
+				free(buf);
+		return result;
+}
+
+
+/*
+ * Executes all commands in <const char *buf> of <size_t size> bytes.
+ * Each line is passed to parse_command() and execute_command() in place.
+ * A compiled file (starting with BINARY_MAGIC) is decoded record by
+ * record instead.
+ * Function handles commando-files both with and without one trailing newline.
+ * Runs of consecutive 'finnes_rute' and 'print' commands are collected and
+ * answered together by run_path_batch(), in the order they appear in the
+ * file, and executed together by read_run_flush().
+ * Returns CRITICAL_FAILURE if a command was invalid, SUCCESS otherwise.
+ */
+int run_command_buffer(const char *buf, size_t size)
+{
+		int result = SUCCESS;
+		struct path_batch batch = { 0 };
+		struct command cmd;
+		if (size >= 4 && memcmp(buf, BINARY_MAGIC, 4) == 0) {
+				size_t pos = 4;
+				while (pos < size && result != CRITICAL_FAILURE) {
+						if (decode_command((unsigned char *) buf, size, &pos, &cmd) != SUCCESS) {
+								fprintf(stderr, "%sError%s: incomplete or unknown command at byte %zu of compiled commands-file\n", CLR_RED, CLR_NRM, pos);
+								result = CRITICAL_FAILURE;
+						} else {
+								result = dispatch_command(&cmd, &batch);
+						}
+				}
+		} else {
+				const char *p = buf;
+				const char *end = buf + size;
+				while (p < end && result != CRITICAL_FAILURE) {
+						const char *newline = memchr(p, '\n', end - p);
+						const char *line_end = newline ? newline : end;
+						parse_command(p, line_end - p, &cmd);
+						result = dispatch_command(&cmd, &batch);
+						p = line_end + 1;
+				}
+		}
+		if (result != CRITICAL_FAILURE)
+				run_path_batch(&batch);
+		read_run_flush();
+
+		batch_free(&batch);
+		return result == CRITICAL_FAILURE ? CRITICAL_FAILURE : SUCCESS;
+}
+
+
+/*
+ * Executes the commands of the pipe, FIFO or terminal <FILE *fh> as they
+ * arrive. Each complete line is run at once, and whenever no more input is
+ * waiting (or STREAM_FLUSH_COMMANDS commands have been run) the collected
+ * path queries and read-only commands are executed and stdout is flushed,
+ * so no result waits for commands that have not arrived yet.
+ * A compiled stream is read to its end and then run by run_command_buffer().
+ * Returns as run_all_commands().
+ */
+int run_command_stream(FILE *fh)
+{
+		int fd = fileno(fh);
+		size_t capacity = STREAM_BUFFER_SIZE;
+		size_t len = 0;                 /* Bytes of unfinished lines in buf */
+		size_t total = 0;               /* Bytes read from the stream */
+		char *buf = malloc(capacity);
+		if (!(buf)) {
+				perror("Error with malloc");
+				return CRITICAL_FAILURE;
+		}
+
+		int result = SUCCESS;
+		int binary = -1;                /* Not known before 4 bytes are read */
+		int pending = 0;                /* Commands run since the last flush */
+		int at_eof = FALSE;
+		struct path_batch batch = { 0 };
+		struct command cmd;
+		while (!(at_eof) && result != CRITICAL_FAILURE) {
+				if (len == capacity) {
+						char *tmp = realloc(buf, capacity * 2);
+						if (!(tmp)) {
+								perror("Error with realloc");
+								result = CRITICAL_FAILURE;
+								break;
+						}
+						buf = tmp;
+						capacity *= 2;
+				}
+				ssize_t n = read(fd, buf + len, capacity - len);
+				if (n < 0) {
+						if (errno == EINTR)
+								continue;
+						perror("Error when reading commands");
+						result = CRITICAL_FAILURE;
+						break;
+				}
+				at_eof = n == 0;
+				len += n;
+				total += n;
+				if (binary == -1 && (total >= 4 || at_eof))
+						binary = total >= 4 && memcmp(buf, BINARY_MAGIC, 4) == 0;
+				if (binary != FALSE)
+						continue;
+
+				/* Run the complete lines, and the last line at the end of the stream */
+				char *p = buf;
+				char *end = buf + len;
+				while (result != CRITICAL_FAILURE && p < end) {
+						char *newline = memchr(p, '\n', end - p);
+						if (!(newline) && !(at_eof))
+								break;
+						char *line_end = newline ? newline : end;
+						parse_command(p, line_end - p, &cmd);
+						result = dispatch_command(&cmd, &batch);
+						p = line_end + 1;
+						if (++pending >= STREAM_FLUSH_COMMANDS) {
+								stream_flush(&batch);
+								pending = 0;
+						}
+				}
+				len = p < end ? (size_t) (end - p) : 0;
+				memmove(buf, p < end ? p : end, len);
+
+				/* Answer everything run so far before waiting for more input */
+				struct pollfd waiting = { .fd = fd, .events = POLLIN };
+				if (pending > 0 && result != CRITICAL_FAILURE && poll(&waiting, 1, 0) == 0) {
+						stream_flush(&batch);
+						pending = 0;
+				}
+		}
+
+		if (binary == TRUE && result != CRITICAL_FAILURE) {
+				result = run_command_buffer(buf, len);
+		} else {
+				if (result != CRITICAL_FAILURE)
+						run_path_batch(&batch);
+				read_run_flush();
+		}
+		free(buf);
+		batch_free(&batch);
+		if (total == 0 && result != CRITICAL_FAILURE) {
+				fprintf(stderr, "%sWarning%s: Commands-file is empty.\n", CLR_RED, CLR_NRM);
+				return FAILURE;
+		}
+		return result == CRITICAL_FAILURE ? CRITICAL_FAILURE : SUCCESS;
+}
+
+
+/* Executes the collected path queries and read-only commands, and flushes stdout */
+void stream_flush(struct path_batch *batch)
+{
+		run_path_batch(batch);
+		read_run_flush();
+		fflush(stdout);
+}
+
+
+
+/*
+ * Collects <struct command *cmd> in <struct path_batch *batch> if it is a
+ * path query or prints a router. Any other command first runs the batch
+ * and the read run, and is then executed.
+ * Returns as execute_command().
+ */
+int dispatch_command(struct command *cmd, struct path_batch *batch)
+{
+		/* Collect read-only commands, and run them before any other command */
+		if (cmd->kind == CMD_FINNES_RUTE && cmd->n_args == 2
+			&& batch_add(batch, cmd->args[0], cmd->args[1], FALSE) == SUCCESS)
+				return SUCCESS;
+		if (cmd->kind == CMD_PRINT && cmd->n_args >= 1
+			&& batch_add(batch, cmd->args[0], 0, TRUE) == SUCCESS)
+				return SUCCESS;
+		run_path_batch(batch);
+		read_run_flush();
+		if (!(stats.enabled))
+				return execute_command(cmd);
+
+		uint64_t start = stats_now();
+		int result = execute_command(cmd);
+		stats_record_command(cmd->kind, stats_now() - start, result != SUCCESS);
+		return result;
+}
+
+
+/*
+ * Decodes the record starting at <size_t *pos> in the compiled commands
+ * <const unsigned char *buf> of <size_t size> bytes into <struct command *cmd>,
+ * and moves *pos past it. Strings point into buf.
+ * Returns FAILURE (leaving *pos) if the record is incomplete or unknown.
+ */
+int decode_command(const unsigned char *buf, size_t size, size_t *pos, struct command *cmd)
+{
+		const unsigned char *rec = buf + *pos;
+		size_t left = size - *pos;
+		size_t len;
+		cmd->text = NULL;
+		cmd->text_len = 0;
+		switch (rec[0]) {
+		case BIN_PRINT:
+				cmd->kind = CMD_PRINT;
+				cmd->keyword = "print";
+				cmd->keyword_len = 5;
+				cmd->n_args = 1;
+				len = 5;
+				break;
+		case BIN_SETT_FLAG:
+				cmd->kind = CMD_SETT_FLAG;
+				cmd->keyword = "sett_flag";
+				cmd->keyword_len = 9;
+				cmd->n_args = 3;
+				len = 7;
+				break;
+		case BIN_SETT_MODELL:
+				cmd->kind = CMD_SETT_MODELL;
+				cmd->keyword = "sett_modell";
+				cmd->keyword_len = 11;
+				cmd->n_args = 1;
+				len = 6;
+				break;
+		case BIN_LEGG_TIL_KOBLING:
+				cmd->kind = CMD_LEGG_TIL_KOBLING;
+				cmd->keyword = "legg_til_kobling";
+				cmd->keyword_len = 16;
+				cmd->n_args = 2;
+				len = 9;
+				break;
+		case BIN_SLETT_ROUTER:
+				cmd->kind = CMD_SLETT_ROUTER;
+				cmd->keyword = "slett_router";
+				cmd->keyword_len = 12;
+				cmd->n_args = 1;
+				len = 5;
+				break;
+		case BIN_FINNES_RUTE:
+				cmd->kind = CMD_FINNES_RUTE;
+				cmd->keyword = "finnes_rute";
+				cmd->keyword_len = 11;
+				cmd->n_args = 2;
+				len = 9;
+				break;
+		case BIN_SCC_INDEKS:
+				cmd->kind = CMD_SCC_INDEKS;
+				cmd->keyword = "scc_indeks";
+				cmd->keyword_len = 10;
+				cmd->n_args = 0;
+				len = 2;
+				break;
+		default:
+				return FAILURE;
+		}
+		if (left < len)
+				return FAILURE;
+
+		if (cmd->n_args >= 1)
+				cmd->args[0] = get_u32le(rec + 1);
+		if (cmd->kind == CMD_SETT_FLAG) {
+				cmd->args[1] = rec[5];
+				cmd->args[2] = rec[6];
+		} else if (cmd->n_args == 2) {
+				cmd->args[1] = get_u32le(rec + 5);
+		} else if (cmd->kind == CMD_SETT_MODELL || cmd->kind == CMD_SCC_INDEKS) {
+				/* Length-prefixed string */
+				cmd->text_len = rec[len - 1];
+				cmd->text = (const char *) rec + len;
+				len += cmd->text_len;
+				if (left < len)
+						return FAILURE;
+				if (cmd->kind == CMD_SCC_INDEKS && cmd->text_len == 0)
+						cmd->text = NULL;
+		}
+		*pos += len;
+		return SUCCESS;
+}
+
+
+/*
+ * Compiles the text commands-file <char text_name[]> into the binary
+ * commands-file <char binary_name[]>, which run_all_commands() runs without
+ * parsing. Lines with too few arguments are left out with a warning, as
+ * running them would do nothing.
+ * Returns FAILURE (after printing an error) if a line is not a command
+ * or a file could not be read or written.
+ */
+int convert_commands(char text_name[], char binary_name[])
+{
+		FILE *fh = open_file(text_name, "r");
+		if (!(fh))
+				return FAILURE;
+		size_t size;
+		int mapped;
+		char *buf = map_command_file(fh, &size, &mapped);
+		fclose(fh);
+		if (!(buf) && size != 0)
+				return FAILURE;
+
+		struct write_buffer b = { .fd = open(binary_name, O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+		if (b.fd == -1) {
+				fprintf(stderr, "%sError%s when trying to open file called '%s':\n      ", CLR_RED, CLR_NRM, binary_name);
+				perror("");
+				if (mapped)
+						munmap(buf, size);
+				else
+						free(buf);
+				return FAILURE;
+		}
+		b.data = malloc(WRITE_BUFFER_SIZE);
+		if (!(b.data)) {
+				perror("Error with malloc");
+				b.failed = TRUE;
+		} else {
+				memcpy(wbuf_reserve(&b, 4), BINARY_MAGIC, 4);
+		}
+
+		struct command cmd;
+		int line_no = 1;
+		size_t n_commands = 0;
+		const char *p = buf;
+		const char *end = buf + size;
+		while (p < end && !(b.failed)) {
+				const char *newline = memchr(p, '\n', end - p);
+				const char *line_end = newline ? newline : end;
+				parse_command(p, line_end - p, &cmd);
+				if (cmd.kind == CMD_INVALID) {
+						fprintf(stderr, "%sError%s: '%.*s' on line %d is not a valid command\n", CLR_RED, CLR_NRM, cmd.keyword_len, cmd.keyword, line_no);
+						b.failed = TRUE;
+				} else if (encode_command(&b, &cmd) == SUCCESS) {
+						n_commands++;
+				} else {
+						fprintf(stderr, "Line %d: ", line_no);
+						print_missing_arguments(&cmd);
+				}
+				p = line_end + 1;
+				line_no++;
+		}
+
+		int result = b.failed ? FAILURE : SUCCESS;
+		if (b.data && wbuf_flush(&b) != SUCCESS)
+				result = FAILURE;
+		if (close(b.fd) != 0)
+				result = FAILURE;
+		free(b.data);
+		if (mapped)
+				munmap(buf, size);
+		else
+				free(buf);
+		if (result == SUCCESS)
+				printf("Compiled %zu commands from '%s' to '%s'\n", n_commands, text_name, binary_name);
+		return result;
+}
+
+
+/*
+ * Appends the record of <struct command *cmd> to <struct write_buffer *b>.
+ * Strings longer than DESC_MAX_LEN are cut, as set_model() would.
+ * Returns FAILURE if the command has too few arguments.
+ */
+int encode_command(struct write_buffer *b, struct command *cmd)
+{
+		unsigned char *dest;
+		int len;
+		switch (cmd->kind) {
+		case CMD_PRINT:
+		case CMD_SLETT_ROUTER:
+				if (cmd->n_args < 1)
+						return FAILURE;
+				dest = wbuf_reserve(b, 5);
+				dest[0] = cmd->kind == CMD_PRINT ? BIN_PRINT : BIN_SLETT_ROUTER;
+				put_u32le(dest + 1, cmd->args[0]);
+				break;
+		case CMD_SETT_FLAG:
+				if (cmd->n_args < 3)
+						return FAILURE;
+				dest = wbuf_reserve(b, 7);
+				dest[0] = BIN_SETT_FLAG;
+				put_u32le(dest + 1, cmd->args[0]);
+				dest[5] = cmd->args[1];
+				dest[6] = cmd->args[2];
+				break;
+		case CMD_LEGG_TIL_KOBLING:
+		case CMD_FINNES_RUTE:
+				if (cmd->n_args < 2)
+						return FAILURE;
+				dest = wbuf_reserve(b, 9);
+				dest[0] = cmd->kind == CMD_FINNES_RUTE ? BIN_FINNES_RUTE : BIN_LEGG_TIL_KOBLING;
+				put_u32le(dest + 1, cmd->args[0]);
+				put_u32le(dest + 5, cmd->args[1]);
+				break;
+		case CMD_SETT_MODELL:
+				if (cmd->n_args < 1 || !(cmd->text))
+						return FAILURE;
+				len = cmd->text_len > DESC_MAX_LEN ? DESC_MAX_LEN : cmd->text_len;
+				dest = wbuf_reserve(b, 6 + len);
+				dest[0] = BIN_SETT_MODELL;
+				put_u32le(dest + 1, cmd->args[0]);
+				dest[5] = len;
+				memcpy(dest + 6, cmd->text, len);
+				break;
+		case CMD_SCC_INDEKS:
+				len = cmd->text_len > DESC_MAX_LEN ? DESC_MAX_LEN : cmd->text_len;
+				dest = wbuf_reserve(b, 2 + len);
+				dest[0] = BIN_SCC_INDEKS;
+				dest[1] = len;
+				memcpy(dest + 2, cmd->text, len);
+				break;
+		case CMD_INVALID:
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+/* Returns the 4 byte little-endian number at <const unsigned char *src> */
+unsigned int get_u32le(const unsigned char *src)
+{
+		return (unsigned int) src[0] | (unsigned int) src[1] << 8
+				| (unsigned int) src[2] << 16 | (unsigned int) src[3] << 24;
+}
+
+
+/* Writes <unsigned int value> as a 4 byte little-endian number to <dest> */
+void put_u32le(unsigned char *dest, unsigned int value)
+{
+		dest[0] = value;
+		dest[1] = value >> 8;
+		dest[2] = value >> 16;
+		dest[3] = value >> 24;
+}
+
+
+
+/* --- PATH SEARCH FUNCTIONS --- */
+
+/*
+ * Grow the array pointed to by <void **array> from <int old_capacity> to
+ * <int capacity> elements of size <size_t elem_size>, zeroing the new elements.
+ * On failure the old array is left untouched.
+ */
+int grow_array(void **array, size_t elem_size, int old_capacity, int capacity)
+{
+		char *tmp = realloc(*array, elem_size * capacity);
+		if (!(tmp)) {
+				perror("Error with realloc");
+				return FAILURE;
+		}
+		memset(tmp + elem_size * old_capacity, 0, elem_size * (capacity - old_capacity));
+		*array = tmp;
+		return SUCCESS;
+}
+
+
+/*
+ * Make sure the scratch space <struct search_scratch *s> has room for
+ * <int capacity> router slots (and a path of capacity + 1 IDs).
+ * New stamps are zeroed, so they do not look visited in the current epoch.
+ * Memory is kept between searches and freed in scratch_free().
+ */
+int scratch_reserve(struct search_scratch *s, int capacity)
+{
+		if (capacity <= s->capacity)
+				return SUCCESS;
+
+		int old = s->capacity;
+		if (grow_array((void **) &s->stamp, sizeof(unsigned int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->parent, sizeof(int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->queue, sizeof(int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->dist, sizeof(int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->stamp_back, sizeof(unsigned int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->parent_back, sizeof(int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->queue_back, sizeof(int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->dist_back, sizeof(int), old, capacity) != SUCCESS
+			|| grow_array((void **) &s->path, sizeof(unsigned int), old ? old + 1 : 0, capacity + 1) != SUCCESS)
+				return FAILURE;
+
+		s->capacity = capacity;
+		return SUCCESS;
+}
+
+
+/*
+ * Start a new search by moving to the next epoch, which marks every slot
+ * as not visited. Stamps are only cleared when the epoch counter wraps.
+ */
+void scratch_new_epoch(struct search_scratch *s)
+{
+		if (s->epoch == UINT_MAX) {
+				memset(s->stamp, 0, sizeof(unsigned int) * s->capacity);
+				memset(s->stamp_back, 0, sizeof(unsigned int) * s->capacity);
+				s->epoch = 0;
+		}
+		s->epoch++;
+}
+
+
+/* Free memory allocated to the scratch space <struct search_scratch *s> */
+void scratch_free(struct search_scratch *s)
+{
+		free(s->stamp);
+		free(s->parent);
+		free(s->queue);
+		free(s->dist);
+		free(s->stamp_back);
+		free(s->parent_back);
+		free(s->queue_back);
+		free(s->dist_back);
+		free(s->path);
+		memset(s, 0, sizeof(struct search_scratch));
+}
+
+
+/*
+ * Writes the IDs of the routers on the path from <int from_slot> to
+ * <int to_slot> into s->path, by following <int *parent> back from
+ * <int last_slot> (the router which has a connection to to_slot).
+ * Returns the number of IDs in the path.
+ */
+int build_path(struct search_scratch *s, int *parent, int from_slot, int last_slot, int to_slot)
+{
+		int len = 1;
+		for (int cur = last_slot; cur != from_slot; cur = parent[cur])
+				len++;
+
+		/* Fill path backwards, ending with the to-router */
+		s->path[len] = graph_router_id(s->snapshot, to_slot);
+		int i = len - 1;
+		for (int cur = last_slot; cur != from_slot; cur = parent[cur])
+				s->path[i--] = graph_router_id(s->snapshot, cur);
+		s->path[0] = graph_router_id(s->snapshot, from_slot);
+		return len + 1;
+}
+
+
+/*
+ * Iterative breadth first search from router in <int from_slot> to router
+ * in <int to_slot>, using the scratch space <struct search_scratch *s>.
+ * Finds a path with the fewest possible hops. A path from a router to itself
+ * must contain at least one connection (a cycle).
+ * Returns the number of IDs written to s->path, or 0 if there is no path.
+ */
+int bfs_search(struct search_scratch *s, int from_slot, int to_slot)
+{
+		if (scratch_reserve(s, N) != SUCCESS)
+				return 0;
+		scratch_new_epoch(s);
+
+		unsigned int epoch = s->epoch;
+		int head = 0;
+		int tail = 0;
+		s->stamp[from_slot] = epoch;
+		s->queue[tail++] = from_slot;
+
+		/* The live graph, the common case, has a loop of its own, which
+		 * ran clearly slower when shared with the loop over a snapshot */
+		struct router *r;
+		const int *conn;
+		int n_conn;
+		if (!(s->snapshot)) {
+				while (head < tail) {
+						int cur = s->queue[head++];
+						r = router_array[cur];
+						conn = adjacency.target + r->conn_start;
+						for (int i = 0; i < r->n_conn; i++) {
+								int next = conn[i];
+								if (next == to_slot) {
+										s->visited = head;
+										return build_path(s, s->parent, from_slot, cur, to_slot);
+								}
+								if (s->stamp[next] != epoch) {
+										s->stamp[next] = epoch;
+										s->parent[next] = cur;
+										s->queue[tail++] = next;
+								}
+						}
+				}
+		} else {
+				while (head < tail) {
+						int cur = s->queue[head++];
+						n_conn = snapshot_connections(s->snapshot, cur, &conn);
+						for (int i = 0; i < n_conn; i++) {
+								int next = conn[i];
+								if (next == to_slot) {
+										s->visited = head;
+										return build_path(s, s->parent, from_slot, cur, to_slot);
+								}
+								if (s->stamp[next] != epoch) {
+										s->stamp[next] = epoch;
+										s->parent[next] = cur;
+										s->queue[tail++] = next;
+								}
+						}
+				}
+		}
+		s->visited = head;
+		return 0;
+}
+
+
+/*
+ * Writes the IDs of the routers on the path found by bidir_search() into
+ * s->path, starting with the from-router. The path meets in the connection from <int meet_from> (reached by
+ * the forward search) to <int meet_to> (reached by the backward search).
+ * Returns the number of IDs in the path.
+ */
+int build_bidir_path(struct search_scratch *s, int meet_from, int meet_to)
+{
+		/* Forward half, written backwards from meet_from to from_slot */
+		int len = s->dist[meet_from] + 1;
+		int cur = meet_from;
+		for (int i = len - 1; i >= 0; i--) {
+				s->path[i] = graph_router_id(s->snapshot, cur);
+				cur = s->parent[cur];
+		}
+
+		/* Backward half, from meet_to along parents to to-router */
+		cur = meet_to;
+		for (int i = 0; i <= s->dist_back[meet_to]; i++) {
+				s->path[len++] = graph_router_id(s->snapshot, cur);
+				cur = s->parent_back[cur];
+		}
+		return len;
+}
+
+
+/*
+ * Expands one whole level of the forward frontier queue[*head, *tail) along
+ * connections. A connection into a router reached by the backward search is
+ * a meeting point; the shortest one is kept in <best>, <meet_from> and <meet_to>.
+ * Returns TRUE if a meeting point was found in this level.
+ */
+int expand_forward(struct search_scratch *s, int *head, int *tail, int *best, int *meet_from, int *meet_to)
+{
+		unsigned int epoch = s->epoch;
+		int level_end = *tail;
+		int found = FALSE;
+		const int *conn;
+		int n_conn;
+		while (*head < level_end) {
+				int cur = s->queue[(*head)++];
+				if (s->snapshot) {
+						n_conn = snapshot_connections(s->snapshot, cur, &conn);
+				} else {
+						conn = adjacency.target + router_array[cur]->conn_start;
+						n_conn = router_array[cur]->n_conn;
+				}
+				for (int i = 0; i < n_conn; i++) {
+						int next = conn[i];
+						if (s->stamp_back[next] == epoch) {
+								int len = s->dist[cur] + 1 + s->dist_back[next];
+								if (len < *best) {
+										*best = len;
+										*meet_from = cur;
+										*meet_to = next;
+								}
+								found = TRUE;
+						} else if (s->stamp[next] != epoch) {
+								s->stamp[next] = epoch;
+								s->parent[next] = cur;
+								s->dist[next] = s->dist[cur] + 1;
+								s->queue[(*tail)++] = next;
+						}
+				}
+		}
+		return found;
+}
+
+
+/*
+ * Backward counterpart of expand_forward(), expanding one level of
+ * queue_back[*head, *tail) along the incoming connections of each router.
+ */
+int expand_backward(struct search_scratch *s, int *head, int *tail, int *best, int *meet_from, int *meet_to)
+{
+		unsigned int epoch = s->epoch;
+		int level_end = *tail;
+		int found = FALSE;
+		struct router **incoming = NULL;
+		const int *in = NULL;
+		int n_in;
+		while (*head < level_end) {
+				int cur = s->queue_back[(*head)++];
+				if (s->snapshot) {
+						n_in = snapshot_incoming(s->snapshot, cur, &in);
+				} else {
+						incoming = router_array[cur]->incoming;
+						n_in = router_array[cur]->n_incoming;
+				}
+				for (int i = 0; i < n_in; i++) {
+						int prev = in ? in[i] : incoming[i]->slot;
+						if (s->stamp[prev] == epoch) {
+								int len = s->dist[prev] + 1 + s->dist_back[cur];
+								if (len < *best) {
+										*best = len;
+										*meet_from = prev;
+										*meet_to = cur;
+								}
+								found = TRUE;
+						} else if (s->stamp_back[prev] != epoch) {
+								s->stamp_back[prev] = epoch;
+								s->parent_back[prev] = cur;
+								s->dist_back[prev] = s->dist_back[cur] + 1;
+								s->queue_back[(*tail)++] = prev;
+						}
+				}
+		}
+		return found;
+}
+
+
+/*
+ * Bidirectional breadth first search: a forward search from <int from_slot>
+ * along connections, and a backward search from <int to_slot> along incoming
+ * connections. The side with the smaller frontier is expanded one level at a
+ * time, until the two searches meet. Finds a path with the fewest hops.
+ * Returns the number of IDs written to s->path, or 0 if there is no path.
+ */
+int bidir_search(struct search_scratch *s, int from_slot, int to_slot)
+{
+		/* A path to itself is a cycle, which the forward search handles */
+		if (from_slot == to_slot)
+				return bfs_search(s, from_slot, to_slot);
+
+		if (scratch_reserve(s, N) != SUCCESS)
+				return 0;
+		scratch_new_epoch(s);
+
+		int head = 0, tail = 0, head_back = 0, tail_back = 0;
+		s->stamp[from_slot] = s->epoch;
+		s->dist[from_slot] = 0;
+		s->queue[tail++] = from_slot;
+		s->stamp_back[to_slot] = s->epoch;
+		s->dist_back[to_slot] = 0;
+		s->parent_back[to_slot] = to_slot;
+		s->queue_back[tail_back++] = to_slot;
+
+		int best = INT_MAX;
+		int meet_from = -1, meet_to = -1;
+		int found = FALSE;
+		while (!(found) && head < tail && head_back < tail_back) {
+				if (tail - head <= tail_back - head_back)
+						found = expand_forward(s, &head, &tail, &best, &meet_from, &meet_to);
+				else
+						found = expand_backward(s, &head_back, &tail_back, &best, &meet_from, &meet_to);
+		}
+		s->visited = head + head_back;
+		if (!(found))
+				return 0;
+		return build_bidir_path(s, meet_from, meet_to);
+}
+
+
+/*
+ * Runs the search engine chosen by the global search_mode, on s->snapshot
+ * if set. SEARCH_AUTO uses the bidirectional search on large graphs only,
+ * since the forward search has less overhead on small ones.
+ */
+int search_path(struct search_scratch *s, int from_slot, int to_slot)
+{
+		int n_routers = s->snapshot ? s->snapshot->n_routers : N_ROUTERS;
+		if (search_mode == SEARCH_BIDIRECTIONAL
+			|| (search_mode == SEARCH_AUTO && n_routers >= BIDIR_MIN_ROUTERS))
+				return bidir_search(s, from_slot, to_slot);
+		return bfs_search(s, from_slot, to_slot);
+}
+
+
+/*
+ * Returns the cached search tree for router in <int from_slot>, if one
+ * exists and was built in the current graph epoch. Returns NULL otherwise.
+ */
+struct reach_entry *reach_cache_lookup(int from_slot)
+{
+		for (int i = 0; i < REACH_CACHE_ENTRIES; i++) {
+				struct reach_entry *e = &reach_cache.entries[i];
+				if (e->reachable && e->source == from_slot && e->epoch == graph_epoch) {
+						e->last_used = ++reach_cache.clock;
+						return e;
+				}
+		}
+		return NULL;
+}
+
+
+/*
+ * Builds the complete search tree from router in <int from_slot> into the
+ * least recently used cache entry, using the queue and stamps of
+ * <struct search_scratch *s>. The tree is the one bfs_search() walks,
+ * so paths read from it are the same as those bfs_search() finds.
+ * Returns the entry, or NULL on allocation failure.
+ */
+struct reach_entry *reach_cache_build(struct search_scratch *s, int from_slot)
+{
+		struct reach_entry *e = &reach_cache.entries[0];
+		for (int i = 1; i < REACH_CACHE_ENTRIES; i++) {
+				if (reach_cache.entries[i].last_used < e->last_used)
+						e = &reach_cache.entries[i];
+		}
+
+		int words = (N + 63) / 64;
+		if (e->capacity < N) {
+				free(e->reachable);
+				free(e->parent);
+				e->reachable = malloc(sizeof(uint64_t) * words);
+				e->parent = malloc(sizeof(int) * N);
+				if (!(e->reachable) || !(e->parent)) {
+						perror("Error with malloc");
+						free(e->reachable);
+						free(e->parent);
+						memset(e, 0, sizeof(struct reach_entry));
+						return NULL;
+				}
+				e->capacity = N;
+		}
+		if (scratch_reserve(s, N) != SUCCESS)
+				return NULL;
+		scratch_new_epoch(s);
+		memset(e->reachable, 0, sizeof(uint64_t) * words);
+
+		unsigned int epoch = s->epoch;
+		int head = 0;
+		int tail = 0;
+		s->stamp[from_slot] = epoch;
+		s->queue[tail++] = from_slot;
+
+		struct router *r;
+		while (head < tail) {
+				int cur = s->queue[head++];
+				r = router_array[cur];
+				int *conn = adjacency.target + r->conn_start;
+				for (int i = 0; i < r->n_conn; i++) {
+						int next = conn[i];
+						if (s->stamp[next] != epoch) {
+								s->stamp[next] = epoch;
+								e->parent[next] = cur;
+								e->reachable[next / 64] |= (uint64_t) 1 << (next % 64);
+								s->queue[tail++] = next;
+						}
+				}
+		}
+
+		s->visited = head;
+		e->source = from_slot;
+		e->epoch = graph_epoch;
+		e->last_used = ++reach_cache.clock;
+		return e;
+}
+
+
+/*
+ * Returns TRUE if router in <int from_slot> has been searched from before in
+ * this graph epoch, and registers it as a candidate for a tree otherwise.
+ */
+int reach_cache_is_candidate(int from_slot)
+{
+		if (reach_cache.candidate_epoch != graph_epoch) {
+				for (int i = 0; i < REACH_CACHE_ENTRIES; i++)
+						reach_cache.candidates[i] = INDEX_EMPTY;
+				reach_cache.candidate_epoch = graph_epoch;
+		}
+		for (int i = 0; i < REACH_CACHE_ENTRIES; i++) {
+				if (reach_cache.candidates[i] == from_slot)
+						return TRUE;
+		}
+		reach_cache.candidates[reach_cache.next_candidate] = from_slot;
+		reach_cache.next_candidate = (reach_cache.next_candidate + 1) % REACH_CACHE_ENTRIES;
+		return FALSE;
+}
+
+
+/*
+ * Writes the path to router in <int to_slot> from the source of the search
+ * tree <struct reach_entry *e> into s->path.
+ * Returns the number of IDs in the path, or 0 if to_slot is not reachable.
+ */
+int reach_entry_path(struct search_scratch *s, struct reach_entry *e, int to_slot)
+{
+		if (!(e->reachable[to_slot / 64] & ((uint64_t) 1 << (to_slot % 64))))
+				return 0;
+		if (scratch_reserve(s, N) != SUCCESS)
+				return 0;
+		return build_path(s, e->parent, e->source, e->parent[to_slot], to_slot);
+}
+
+
+/*
+ * Finds a path from router in <int from_slot> to router in <int to_slot>
+ * in the reachability cache. Sources searched from repeatedly get a full
+ * search tree, so later queries only cost the path reconstruction.
+ * Returns the number of IDs written to s->path, 0 if there is no path,
+ * or SEARCH_NEEDED if the query must go to search_path().
+ */
+int cached_search_path(struct search_scratch *s, int from_slot, int to_slot)
+{
+		/* A path to itself is a cycle, which the tree does not describe */
+		if (!(reach_cache.enabled) || from_slot == to_slot)
+				return SEARCH_NEEDED;
+
+		struct reach_entry *e = reach_cache_get(s, from_slot);
+		if (!(e))
+				return SEARCH_NEEDED;
+		return reach_entry_path(s, e, to_slot);
+}
+
+
+/*
+ * Returns the cached search tree of router in <int from_slot>, building it
+ * if the router is a repeated source. Returns NULL if there is no tree.
+ */
+struct reach_entry *reach_cache_get(struct search_scratch *s, int from_slot)
+{
+		struct reach_entry *e = reach_cache_lookup(from_slot);
+		if (!(e) && reach_cache_is_candidate(from_slot))
+				e = reach_cache_build(s, from_slot);
+		return e;
+}
+
+
+/* Free memory allocated to the search trees in the reachability cache */
+void reach_cache_free()
+{
+		for (int i = 0; i < REACH_CACHE_ENTRIES; i++) {
+				free(reach_cache.entries[i].reachable);
+				free(reach_cache.entries[i].parent);
+				memset(&reach_cache.entries[i], 0, sizeof(struct reach_entry));
+		}
+}
+
+
+/*
+ * Answers a path query from router in <int from_slot> to router in
+ * <int to_slot> without searching, if it can. Pairs the SCC index
+ * (if enabled) proves unreachable have no path; the rest go through
+ * the reachability cache.
+ * Returns as cached_search_path().
+ */
+int answer_path(struct search_scratch *s, int from_slot, int to_slot)
+{
+		if (scc_index.enabled && scc_reachable(from_slot, to_slot) == FALSE)
+				return 0;
+		return cached_search_path(s, from_slot, to_slot);
+}
+
+
+/*
+ * Finds a shortest path from router in <int from_slot> to router in
+ * <int to_slot>, with answer_path() or else search_path().
+ * Returns the number of IDs written to s->path, or 0 if there is no path.
+ */
+int find_path(struct search_scratch *s, int from_slot, int to_slot)
+{
+		int path_len = answer_path(s, from_slot, to_slot);
+		if (path_len == SEARCH_NEEDED)
+				path_len = search_path(s, from_slot, to_slot);
+		return path_len;
+}
+
+
+/*
+ * Does the same bookkeeping in the SCC index and reachability cache as
+ * find_path() would, for a query already known to have no path.
+ * Keeps later results identical to running every query through find_path().
+ */
+void note_unreachable(struct search_scratch *s, int from_slot, int to_slot)
+{
+		if (scc_index.enabled && scc_reachable(from_slot, to_slot) == FALSE)
+				return;
+		if (reach_cache.enabled && from_slot != to_slot)
+				reach_cache_get(s, from_slot);
+}
+
+
+/*
+ * Searches for a shortest path from router given by <unsigned int fromID>
+ * to router given by <unsigned int toID>, and prints it if found.
+ * Returns SUCCESS when the search could be run, FAILURE otherwise.
+ */
+int exists_path(unsigned int fromID, unsigned int toID)
+{
+		int from_slot = index_lookup(fromID);
+		int to_slot = index_lookup(toID);
+		if (from_slot == INDEX_EMPTY || to_slot == INDEX_EMPTY)
+				return FAILURE;
+
+		int path_len = find_path(&search_scratch, from_slot, to_slot);
+		print_search_result(stdout, fromID, toID, search_scratch.path, path_len);
+		return SUCCESS;
+}
+
+
+/*
+ * Prints the result of a path search from <unsigned int fromID> to
+ * <unsigned int toID> to <FILE *out>, with the path of <int path_len>
+ * IDs in <unsigned int *path>.
+ */
+void print_search_result(FILE *out, unsigned int fromID, unsigned int toID, unsigned int *path, int path_len)
+{
+		struct out_chunk c;
+		chunk_start(&c, out);
+		if (output_mode == OUTPUT_JSON) {
+				chunk_string(&c, "{\"command\":\"finnes_rute\",\"from\":");
+				chunk_uint(&c, fromID);
+				chunk_string(&c, ",\"to\":");
+				chunk_uint(&c, toID);
+				chunk_string(&c, path_len > 0 ? ",\"found\":true,\"path\":[" : ",\"found\":false,\"path\":[");
+				for (int i = 0; i < path_len; i++) {
+						if (i > 0)
+								chunk_bytes(&c, ",", 1);
+						chunk_uint(&c, path[i]);
+				}
+				chunk_string(&c, "]}\n");
+				chunk_flush(&c);
+				return;
+		}
+
+		chunk_string(&c, "\n- Path search -\n");
+		chunk_string(&c, path_len > 0 ? CLR_GREEN "Found a path" CLR_NRM " from router " : CLR_YELLOW "Could not find a path" CLR_NRM " from router ");
+		chunk_uint(&c, fromID);
+		chunk_string(&c, " to ");
+		chunk_uint(&c, toID);
+		if (path_len > 0) {
+				chunk_string(&c, "!\n");
+				print_path(&c, path, path + path_len);
+		} else {
+				chunk_string(&c, ".\n");
+		}
+		chunk_flush(&c);
+}
+
+
+/* Formats the IDs from <unsigned int path[]> up to <path_cur_ptr> into <struct out_chunk *c> */
+void print_path(struct out_chunk *c, unsigned int path[], unsigned int *path_cur_ptr)
+{
+		chunk_string(c, "Path: ");
+		for (int i = 0; i < (path_cur_ptr - path); i++) {
+				chunk_uint(c, path[i]);
+				chunk_bytes(c, " ", 1);
+		}
+		chunk_bytes(c, "\n", 1);
+}
+
+
+
+/* --- BATCHED PATH SEARCH FUNCTIONS --- */
+
+/*
+ * Appends a path query from <unsigned int fromID> to <unsigned int toID>,
+ * or a 'print' of <unsigned int fromID> if <int is_print> is TRUE, to
+ * <struct path_batch *b>, growing it by doubling.
+ */
+int batch_add(struct path_batch *b, unsigned int fromID, unsigned int toID, int is_print)
+{
+		if (b->count == b->capacity) {
+				int new_cap = b->capacity ? b->capacity * 2 : 64;
+				unsigned int *from = realloc(b->from, sizeof(unsigned int) * new_cap);
+				if (from)
+						b->from = from;
+				unsigned int *to = realloc(b->to, sizeof(unsigned int) * new_cap);
+				if (to)
+						b->to = to;
+				unsigned char *print = realloc(b->is_print, new_cap);
+				if (print)
+						b->is_print = print;
+				if (!(from) || !(to) || !(print)) {
+						perror("Error with realloc");
+						return FAILURE;
+				}
+				b->capacity = new_cap;
+		}
+		b->from[b->count] = fromID;
+		b->to[b->count] = toID;
+		b->is_print[b->count] = is_print;
+		b->count++;
+		if (!(is_print))
+				b->n_queries++;
+		return SUCCESS;
+}
+
+
+/* Free memory allocated to <struct path_batch *b> */
+void batch_free(struct path_batch *b)
+{
+		free(b->from);
+		free(b->to);
+		free(b->is_print);
+		free(b->bits);
+		free(b->pending);
+		free(b->want);
+		memset(b, 0, sizeof(struct path_batch));
+}
+
+
+/*
+ * Bit-parallel reachability from up to BATCH_SOURCES routers at once, over the
+ * condensation DAG of the (built) SCC index. Source k in <int sources[]> owns
+ * bit k. Components are swept from the highest to the lowest number, which is
+ * topological order, so every component has all its bits when it is reached
+ * and each router's connections are followed once per batch of sources.
+ * Afterwards bit k of comp_bits[c] is set if component c contains source k
+ * or can be reached from it. <comp_bits> has room for one word per component.
+ */
+void batch_reachability(int sources[], int n_sources, uint64_t *comp_bits)
+{
+		memset(comp_bits, 0, sizeof(uint64_t) * scc_index.n_components);
+		for (int k = 0; k < n_sources; k++)
+				comp_bits[scc_index.component[sources[k]]] |= (uint64_t) 1 << k;
+
+		for (int c = scc_index.n_components - 1; c >= 0; c--) {
+				uint64_t bits = comp_bits[c];
+				if (!(bits))
+						continue;
+				for (int m = scc_index.first[c]; m < scc_index.first[c + 1]; m++) {
+						struct router *r = router_array[scc_index.members[m]];
+						int *conn = adjacency.target + r->conn_start;
+						for (int j = 0; j < r->n_conn; j++)
+								comp_bits[scc_index.component[conn[j]]] |= bits;
+				}
+		}
+}
+
+
+/*
+ * Returns TRUE if there is a path from router in <int from_slot> (source
+ * bit <int k> in <comp_bits>) to router in <int to_slot>. A path within a
+ * component only exists to the router itself if the component has a cycle.
+ */
+int batch_query_found(int from_slot, int to_slot, int k, uint64_t *comp_bits)
+{
+		int a = scc_index.component[from_slot];
+		int b = scc_index.component[to_slot];
+		if (a == b)
+				return from_slot != to_slot || scc_index.cyclic[a];
+		return (comp_bits[b] >> k) & 1;
+}
+
+
+/*
+ * Returns how many routers a sweep for <int n_queries> path queries may
+ * expand: about what searching for them one by one would spend on queries
+ * without a path, going by the path queries run so far. Returns 0 before
+ * any query without a path has been searched for.
+ */
+long batch_budget(int n_queries)
+{
+		struct read_run *run = &read_run;
+		if (run->n_searched_misses == 0)
+				return 0;
+		double miss_rate = (double) run->n_misses / run->n_queries;
+		double miss_cost = (double) run->miss_visited / run->n_searched_misses;
+		return (long) (n_queries * miss_rate * miss_cost);
+}
+
+
+/*
+ * Bit-parallel breadth first search from up to BATCH_SOURCES routers at
+ * once, over the connections of the graph. Source k in <int sources[]> owns
+ * bit k, and b->want[slot] has bit k set if source k is asked for a path to
+ * the router in slot, <int remaining[k]> such routers in all. A router is
+ * queued while it has bits (pending) not yet passed on to its connections,
+ * and a source's bit stops spreading once all its targets are reached, so
+ * like a single search the sweep ends early when every query has a path.
+ * Afterwards bit k of b->bits[slot] is set if the router in slot was reached
+ * from source k, which for the source itself means it is on a cycle. Unless
+ * all of source k's targets were reached, this holds for every router it
+ * can reach. The sweep gives up after expanding <long budget> routers.
+ * The queues of <struct search_scratch *s> hold the queued routers (as a
+ * ring) and the routers reached, whose number is stored in <int *n_reached>.
+ * Returns TRUE if the sweep finished, FALSE if it gave up.
+ */
+int batch_sweep(struct path_batch *b, struct search_scratch *s, int sources[], int n_sources, int remaining[], long budget, int *n_reached)
+{
+		uint64_t *bits = b->bits;
+		uint64_t *pending = b->pending;
+		uint64_t *want = b->want;
+		int *queue = s->queue;
+		int *reached = s->queue_back;
+		int head = 0;
+		int tail = 0;
+		int n_queued = 0;
+		int n_seen = 0;
+		long expanded = 0;
+		uint64_t live = 0;              /* Sources with targets not reached yet */
+
+		for (int k = 0; k < n_sources; k++) {
+				if (!(pending[sources[k]])) {
+						queue[tail] = sources[k];
+						tail = tail + 1 == N ? 0 : tail + 1;
+						n_queued++;
+				}
+				pending[sources[k]] |= (uint64_t) 1 << k;
+				live |= (uint64_t) 1 << k;
+		}
+
+		while (n_queued > 0 && live && expanded < budget) {
+				int u = queue[head];
+				head = head + 1 == N ? 0 : head + 1;
+				n_queued--;
+				uint64_t new_bits = pending[u] & live;
+				pending[u] = 0;
+				if (!(new_bits))
+						continue;
+				expanded++;
+
+				struct router *r = router_array[u];
+				int *conn = adjacency.target + r->conn_start;
+				for (int j = 0; j < r->n_conn; j++) {
+						int v = conn[j];
+						uint64_t add = new_bits & ~bits[v];
+						if (!(add))
+								continue;
+						if (!(bits[v]))
+								reached[n_seen++] = v;
+						bits[v] |= add;
+						if (!(pending[v])) {
+								queue[tail] = v;
+								tail = tail + 1 == N ? 0 : tail + 1;
+								n_queued++;
+						}
+						pending[v] |= add;
+
+						/* Stop spreading the bits of sources with all targets reached */
+						for (uint64_t hit = add & want[v]; hit; hit &= hit - 1) {
+								int k = __builtin_ctzll(hit);
+								if (--remaining[k] == 0)
+										live &= ~((uint64_t) 1 << k);
+						}
+				}
+		}
+
+		/* Leave no pending bits for the next sweep */
+		int finished = n_queued == 0 || !(live);
+		for (; n_queued > 0; n_queued--) {
+				pending[queue[head]] = 0;
+				head = head + 1 == N ? 0 : head + 1;
+		}
+		*n_reached = n_seen;
+		return finished;
+}
+
+
+/*
+ * Adds the first <int count> entries of <struct path_batch *b> to the read
+ * run in command order. Queries <unsigned char *found> marks as having no
+ * path are answered directly, and the rest with answer_path() or a search
+ * job, so output is the same as running exists_path() for each query.
+ * If <found> is NULL, every query is treated as found.
+ * Returns SUCCESS, or FAILURE if out of memory.
+ */
+int batch_add_jobs(struct path_batch *b, int count, unsigned char *found)
+{
+		struct search_scratch *s = &search_scratch;
+		int result = SUCCESS;
+		for (int q = 0; q < count && result == SUCCESS; q++) {
+				if (b->is_print[q]) {
+						result = read_run_add_print(b->from[q]);
+				} else if (!(find_router(b->from[q]))) {
+						if (!(read_run_add(JOB_INVALID, b->from[q], 0)))
+								result = FAILURE;
+				} else if (!(find_router(b->to[q]))) {
+						if (!(read_run_add(JOB_INVALID, b->to[q], 0)))
+								result = FAILURE;
+				} else if (!(found) || found[q]) {
+						result = read_run_add_query(s, b->from[q], b->to[q], TRUE);
+				} else {
+						note_unreachable(s, index_lookup(b->from[q]), index_lookup(b->to[q]));
+						result = read_run_add_query(s, b->from[q], b->to[q], FALSE);
+				}
+		}
+		return result;
+}
+
+
+/*
+ * Adds all entries in <struct path_batch *b> to the read run and empties it.
+ * A batch of fewer than BATCH_MIN_QUERIES path queries is added as it is.
+ * In a longer one, the distinct sources are taken BATCH_SOURCES at a time,
+ * and which queries have a path is found by batch_sweep(), within the
+ * budget from batch_budget(), or with the SCC index if it is enabled:
+ * directly from its bitsets if it has them, or else by batch_reachability().
+ * Then all entries go to batch_add_jobs().
+ * Returns SUCCESS, or FAILURE if the batch could not be run.
+ */
+int run_path_batch(struct path_batch *b)
+{
+		int count = b->count;
+		int n_queries = b->n_queries;
+		b->count = 0;
+		b->n_queries = 0;
+		if (count == 0)
+				return SUCCESS;
+		if (n_queries < BATCH_MIN_QUERIES)
+				return batch_add_jobs(b, count, NULL);
+
+		uint64_t start = stats.enabled ? stats_now() : 0;
+		if (scc_index.enabled && scc_ensure_built() != SUCCESS)
+				return FAILURE;
+		if (!(scc_index.enabled) && b->n_slots < N) {
+				if (grow_array((void **) &b->bits, sizeof(uint64_t), b->n_slots, N) != SUCCESS
+					|| grow_array((void **) &b->pending, sizeof(uint64_t), b->n_slots, N) != SUCCESS
+					|| grow_array((void **) &b->want, sizeof(uint64_t), b->n_slots, N) != SUCCESS)
+						return FAILURE;
+				b->n_slots = N;
+		}
+		int C = scc_index.enabled ? scc_index.n_components : 0;
+		int *source_of = malloc(sizeof(int) * count);     /* Source number of each query */
+		int *sources = malloc(sizeof(int) * count);       /* Slot of each distinct source */
+		int *next = malloc(sizeof(int) * count);          /* Next query of the same group */
+		int *group_first = malloc(sizeof(int) * (count / BATCH_SOURCES + 1));
+		unsigned char *found = malloc(count);
+		uint64_t *comp_bits = malloc(sizeof(uint64_t) * (C > 0 ? C : 1));
+		if (!(source_of) || !(sources) || !(next) || !(group_first) || !(found) || !(comp_bits)
+			|| scratch_reserve(&search_scratch, N) != SUCCESS) {
+				perror("Error with malloc");
+				free(source_of); free(sources); free(next); free(group_first); free(found); free(comp_bits);
+				return FAILURE;
+		}
+
+		/* Number the distinct sources, using scratch stamps as a slot -> number map */
+		struct search_scratch *s = &search_scratch;
+		scratch_new_epoch(s);
+		int n_sources = 0;
+		for (int q = 0; q < count; q++) {
+				int from_slot = b->is_print[q] ? INDEX_EMPTY : index_lookup(b->from[q]);
+				source_of[q] = -1;
+				found[q] = FALSE;
+				if (from_slot == INDEX_EMPTY || index_lookup(b->to[q]) == INDEX_EMPTY)
+						continue;
+				if (s->stamp[from_slot] != s->epoch) {
+						s->stamp[from_slot] = s->epoch;
+						s->parent[from_slot] = n_sources;
+						sources[n_sources++] = from_slot;
+				}
+				source_of[q] = s->parent[from_slot];
+		}
+
+		/* List the queries of each group of sources, in command order */
+		int n_groups = (n_sources + BATCH_SOURCES - 1) / BATCH_SOURCES;
+		for (int g = 0; g < n_groups; g++)
+				group_first[g] = -1;
+		for (int q = count - 1; q >= 0; q--) {
+				if (source_of[q] < 0)
+						continue;
+				int g = source_of[q] / BATCH_SOURCES;
+				next[q] = group_first[g];
+				group_first[g] = q;
+		}
+
+		/*
+		 * One sweep per group of sources, unless the index has exact bitsets.
+		 * Groups without a budget, or skipped after a sweep gave up, are
+		 * searched one by one.
+		 */
+		for (int g = 0; g < n_groups; g++) {
+				int first = g * BATCH_SOURCES;
+				int n_group = n_sources - first < BATCH_SOURCES ? n_sources - first : BATCH_SOURCES;
+				if (!(scc_index.enabled)) {
+						int n_group_queries = 0;
+						for (int q = group_first[g]; q >= 0; q = next[q])
+								n_group_queries++;
+						long budget = batch_budget(n_group_queries);
+						if (b->skip_groups > 0 || budget == 0) {
+								if (b->skip_groups > 0)
+										b->skip_groups--;
+								for (int q = group_first[g]; q >= 0; q = next[q])
+										found[q] = TRUE;
+								continue;
+						}
+
+						int remaining[BATCH_SOURCES] = { 0 };
+						for (int q = group_first[g]; q >= 0; q = next[q]) {
+								int to_slot = index_lookup(b->to[q]);
+								uint64_t bit = (uint64_t) 1 << (source_of[q] - first);
+								if (!(b->want[to_slot] & bit)) {
+										b->want[to_slot] |= bit;
+										remaining[source_of[q] - first]++;
+								}
+						}
+						int n_reached;
+						int finished = batch_sweep(b, s, sources + first, n_group, remaining, budget, &n_reached);
+						for (int q = group_first[g]; q >= 0; q = next[q]) {
+								int to_slot = index_lookup(b->to[q]);
+								found[q] = !(finished) || ((b->bits[to_slot] >> (source_of[q] - first)) & 1);
+								b->want[to_slot] = 0;
+						}
+						for (int i = 0; i < n_reached; i++)
+								b->bits[s->queue_back[i]] = 0;
+
+						/* Skip twice as many groups after each sweep in a row that gives up */
+						if (finished) {
+								b->backoff = 0;
+						} else {
+								b->backoff = b->backoff > 0 ? b->backoff * 2 : 1;
+								if (b->backoff > BATCH_MAX_BACKOFF)
+										b->backoff = BATCH_MAX_BACKOFF;
+								b->skip_groups = b->backoff;
+						}
+						continue;
+				}
+				if (!(scc_index.reach))
+						batch_reachability(sources + first, n_group, comp_bits);
+				for (int q = group_first[g]; q >= 0; q = next[q]) {
+						int k = source_of[q] - first;
+						int from_slot = sources[source_of[q]];
+						int to_slot = index_lookup(b->to[q]);
+						if (scc_index.reach)
+								found[q] = scc_reachable(from_slot, to_slot);
+						else
+								found[q] = batch_query_found(from_slot, to_slot, k, comp_bits);
+				}
+		}
+
+		if (stats.enabled)
+				stats.phase_ns[PHASE_PATH_BATCHES] += stats_now() - start;
+
+		int result = batch_add_jobs(b, count, found);
+		free(source_of); free(sources); free(next); free(group_first); free(found); free(comp_bits);
+		return result;
+}
+
+
+/* --- PARALLEL READ RUN FUNCTIONS --- */
+
+/*
+ * Appends a job of <enum read_job_kind kind> to the read run, executing
+ * the run first if it is full. Returns the job, or NULL if out of memory.
+ */
+struct read_job *read_run_add(enum read_job_kind kind, unsigned int fromID, unsigned int toID)
+{
+		struct read_run *run = &read_run;
+		if (run->count >= READ_RUN_MAX_JOBS || run->n_paths >= READ_RUN_MAX_PATH_IDS)
+				read_run_flush();
+		if (run->count == run->capacity) {
+				int new_cap = run->capacity ? run->capacity * 2 : 256;
+				if (grow_array((void **) &run->jobs, sizeof(struct read_job), run->capacity, new_cap) != SUCCESS)
+						return NULL;
+				run->capacity = new_cap;
+		}
+		struct read_job *job = &run->jobs[run->count++];
+		job->kind = kind;
+		job->command = kind == JOB_PRINT ? CMD_PRINT : CMD_FINNES_RUTE;
+		job->fromID = fromID;
+		job->toID = toID;
+		job->path_len = 0;
+		job->path_start = 0;
+		job->out_len = 0;
+		job->plan_ns = 0;
+		job->run_ns = 0;
+		job->visited = 0;
+		return job;
+}
+
+
+/*
+ * Adds 'print' of router <unsigned int routerID> to the read run.
+ * Returns SUCCESS, or FAILURE if out of memory.
+ */
+int read_run_add_print(unsigned int routerID)
+{
+		int slot = index_lookup(routerID);
+		struct read_job *job = read_run_add(slot == INDEX_EMPTY ? JOB_INVALID : JOB_PRINT, routerID, 0);
+		if (!(job))
+				return FAILURE;
+		job->command = CMD_PRINT;
+		job->from_slot = slot;
+		return SUCCESS;
+}
+
+
+/*
+ * Adds the path query from <unsigned int fromID> to <unsigned int toID>
+ * (both existing routers) to the read run. It is answered now by
+ * answer_path(), using <struct search_scratch *s>, unless it needs a search.
+ * <int found> is FALSE if the query is already known to have no path.
+ * Returns SUCCESS, or FAILURE if out of memory.
+ */
+int read_run_add_query(struct search_scratch *s, unsigned int fromID, unsigned int toID, int found)
+{
+		struct read_run *run = &read_run;
+		struct read_job *job = read_run_add(JOB_SEARCH, fromID, toID);
+		if (!(job))
+				return FAILURE;
+		job->from_slot = index_lookup(fromID);
+		job->to_slot = index_lookup(toID);
+		uint64_t start = stats.enabled ? stats_now() : 0;
+		s->visited = 0;
+		int path_len = found ? answer_path(s, job->from_slot, job->to_slot) : 0;
+		if (stats.enabled) {
+				job->plan_ns = stats_now() - start;
+				job->visited = s->visited;
+		}
+		if (path_len == SEARCH_NEEDED)
+				return SUCCESS;
+
+		/* Keep the answer, as s->path is overwritten by the next query */
+		job->kind = JOB_RESULT;
+		if (path_len == 0)
+				return SUCCESS;
+		if (run->n_paths + path_len > run->paths_cap) {
+				size_t new_cap = run->paths_cap ? run->paths_cap * 2 : 4096;
+				while (new_cap < run->n_paths + path_len)
+						new_cap *= 2;
+				unsigned int *tmp = realloc(run->paths, sizeof(unsigned int) * new_cap);
+				if (!(tmp)) {
+						perror("Error with realloc");
+						run->count--;
+						return FAILURE;
+				}
+				run->paths = tmp;
+				run->paths_cap = new_cap;
+		}
+		memcpy(run->paths + run->n_paths, s->path, sizeof(unsigned int) * path_len);
+		job->path_start = run->n_paths;
+		job->path_len = path_len;
+		run->n_paths += path_len;
+		return SUCCESS;
+}
+
+
+/*
+ * Executes all jobs in the read run and empties it. Output is printed in
+ * command order. Long runs are split over the worker pool, each worker
+ * printing into its own buffer, and the buffers are then copied to stdout.
+ * Returns SUCCESS.
+ */
+int read_run_flush()
+{
+		struct read_run *run = &read_run;
+		if (run->count == 0)
+				return SUCCESS;
+
+		if (worker_pool.n_threads < 2 || run->count < PARALLEL_MIN_JOBS || pool_start() != SUCCESS) {
+				for (int i = 0; i < run->count; i++) {
+						run_job(&run->jobs[i], &search_scratch, stdout);
+						read_run_count_query(&run->jobs[i]);
+						if (stats.enabled)
+								stats_record_job(&run->jobs[i]);
+				}
+				run->count = 0;
+				run->n_paths = 0;
+				return SUCCESS;
+		}
+
+		atomic_store(&run->next_job, 0);
+		pool_run(run_jobs);
+
+		/* Print the output of the jobs in command order */
+		for (int w = 0; w < worker_pool.n_threads; w++)
+				fflush(worker_pool.workers[w].out);
+		for (int i = 0; i < run->count; i++) {
+				struct read_job *job = &run->jobs[i];
+				if (job->kind == JOB_INVALID && output_mode == OUTPUT_TEXT)
+						print_invalid_routerID(job->fromID);
+				else
+						fwrite(worker_pool.workers[job->worker].out_buf + job->out_start, 1, job->out_len, stdout);
+				read_run_count_query(job);
+				if (stats.enabled)
+						stats_record_job(job);
+		}
+		for (int w = 0; w < worker_pool.n_threads; w++)
+				rewind(worker_pool.workers[w].out);
+		run->count = 0;
+		run->n_paths = 0;
+		return SUCCESS;
+}
+
+
+/* Adds <struct read_job *job> to the totals of path queries in the read run */
+void read_run_count_query(struct read_job *job)
+{
+		if (job->kind != JOB_SEARCH && job->kind != JOB_RESULT)
+				return;
+		read_run.n_queries++;
+		if (job->path_len > 0)
+				return;
+		read_run.n_misses++;
+		if (job->kind == JOB_SEARCH) {
+				read_run.n_searched_misses++;
+				read_run.miss_visited += job->visited;
+		}
+}
+
+
+/* Free memory allocated to the read run */
+void read_run_free()
+{
+		free(read_run.jobs);
+		free(read_run.paths);
+		memset(&read_run, 0, sizeof(struct read_run));
+}
+
+
+/*
+ * Executes <struct read_job *job>, printing its output to <FILE *out>.
+ * Searches use the scratch space <struct search_scratch *s>, and the job
+ * reads the graph in s->snapshot (the live graph if NULL).
+ */
+void run_job(struct read_job *job, struct search_scratch *s, FILE *out)
+{
+		uint64_t start = stats.enabled ? stats_now() : 0;
+		int path_len;
+		switch (job->kind) {
+		case JOB_PRINT:
+				print_router_info(out, s->snapshot, job->from_slot);
+				break;
+		case JOB_INVALID:
+				print_unknown_router(out, job->command, job->fromID);
+				break;
+		case JOB_RESULT:
+				print_search_result(out, job->fromID, job->toID, read_run.paths + job->path_start, job->path_len);
+				break;
+		case JOB_SEARCH:
+				path_len = search_path(s, job->from_slot, job->to_slot);
+				print_search_result(out, job->fromID, job->toID, s->path, path_len);
+				job->path_len = path_len;
+				job->visited += s->visited;
+				break;
+		}
+		if (stats.enabled)
+				job->run_ns = stats_now() - start;
+}
+
+
+/*
+ * Takes jobs from the read run until there are none left, and executes them
+ * in worker <struct worker *w>. Warnings about nonexistent routers are left
+ * to read_run_flush(), since they go to stderr, except in JSON mode.
+ */
+void run_jobs(struct worker *w)
+{
+		struct read_run *run = &read_run;
+		int i;
+		while ((i = atomic_fetch_add(&run->next_job, 1)) < run->count) {
+				struct read_job *job = &run->jobs[i];
+				if (job->kind == JOB_INVALID && output_mode == OUTPUT_TEXT)
+						continue;
+				job->worker = w->id;
+				job->out_start = ftell(w->out);
+				run_job(job, &w->scratch, w->out);
+				job->out_len = ftell(w->out) - job->out_start;
+		}
+}
+
+
+/* Main loop of a worker thread: runs each new task until shutdown */
+void *worker_main(void *arg)
+{
+		struct worker *w = arg;
+		unsigned long seen = 0;
+		pthread_mutex_lock(&worker_pool.lock);
+		for (;;) {
+				while (!(worker_pool.shutdown) && worker_pool.generation == seen)
+						pthread_cond_wait(&worker_pool.work_ready, &worker_pool.lock);
+				if (worker_pool.shutdown)
+						break;
+				seen = worker_pool.generation;
+				pthread_mutex_unlock(&worker_pool.lock);
+				worker_pool.task(w);
+				pthread_mutex_lock(&worker_pool.lock);
+				if (--worker_pool.n_busy == 0)
+						pthread_cond_signal(&worker_pool.work_done);
+		}
+		pthread_mutex_unlock(&worker_pool.lock);
+		return NULL;
+}
+
+
+/*
+ * Starts the worker pool, unless already started. Each worker gets an
+ * output buffer, and all but worker 0 (the main thread) a thread.
+ * If fewer threads could be started, the pool runs with those. The threads
+ * block SIGINT and SIGTERM, so in daemon mode those reach the main thread.
+ * Returns SUCCESS, or FAILURE if the pool has less than two workers.
+ */
+int pool_start()
+{
+		if (worker_pool.started)
+				return SUCCESS;
+		sigset_t blocked, old;
+		sigemptyset(&blocked);
+		sigaddset(&blocked, SIGINT);
+		sigaddset(&blocked, SIGTERM);
+		worker_pool.workers = calloc(worker_pool.n_threads, sizeof(struct worker));
+		if (!(worker_pool.workers)) {
+				perror("Error with calloc");
+				worker_pool.n_threads = 1;
+				return FAILURE;
+		}
+
+		int n = 0;
+		pthread_sigmask(SIG_BLOCK, &blocked, &old);
+		for (; n < worker_pool.n_threads; n++) {
+				struct worker *w = &worker_pool.workers[n];
+				w->id = n;
+				w->out = open_memstream(&w->out_buf, &w->out_size);
+				if (!(w->out)) {
+						perror("Error with open_memstream");
+						break;
+				}
+				if (n > 0 && pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+						fprintf(stderr, "%sWarning%s: could only start %d threads\n", CLR_RED, CLR_NRM, n);
+						fclose(w->out);
+						free(w->out_buf);
+						break;
+				}
+		}
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		worker_pool.n_threads = n;
+		worker_pool.started = TRUE;
+		if (n < 2) {
+				pool_free();
+				worker_pool.n_threads = 1;
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+/*
+ * Runs <task> in every worker of the started pool, the main thread taking
+ * part as worker 0, and returns when all are done.
+ */
+void pool_run(void (*task)(struct worker *w))
+{
+		pthread_mutex_lock(&worker_pool.lock);
+		worker_pool.task = task;
+		worker_pool.n_busy = worker_pool.n_threads - 1;
+		worker_pool.generation++;
+		pthread_cond_broadcast(&worker_pool.work_ready);
+		pthread_mutex_unlock(&worker_pool.lock);
+		task(&worker_pool.workers[0]);
+		pthread_mutex_lock(&worker_pool.lock);
+		while (worker_pool.n_busy > 0)
+				pthread_cond_wait(&worker_pool.work_done, &worker_pool.lock);
+		pthread_mutex_unlock(&worker_pool.lock);
+}
+
+
+/* Stops the threads of the worker pool, and frees its memory */
+void pool_free()
+{
+		if (!(worker_pool.started))
+				return;
+		pthread_mutex_lock(&worker_pool.lock);
+		worker_pool.shutdown = TRUE;
+		pthread_cond_broadcast(&worker_pool.work_ready);
+		pthread_mutex_unlock(&worker_pool.lock);
+
+		for (int w = 0; w < worker_pool.n_threads; w++) {
+				if (w > 0)
+						pthread_join(worker_pool.workers[w].thread, NULL);
+				fclose(worker_pool.workers[w].out);
+				free(worker_pool.workers[w].out_buf);
+				scratch_free(&worker_pool.workers[w].scratch);
+		}
+		free(worker_pool.workers);
+		worker_pool.workers = NULL;
+		worker_pool.started = FALSE;
+		worker_pool.shutdown = FALSE;
+}
+
+
+
+/* --- STATISTICS FUNCTIONS --- */
+
+/* Returns the time of a monotonic clock in nanoseconds */
+uint64_t stats_now()
+{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Returns the histogram bucket of <uint64_t value> */
+int histogram_bucket(uint64_t value)
+{
+		if (value < (1 << STATS_SUB_BITS))
+				return value;
+		int exponent = 63 - __builtin_clzll(value);
+		int sub = (value >> (exponent - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+		return ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+
+/* Returns the lowest value in histogram bucket <int bucket> */
+uint64_t histogram_bucket_low(int bucket)
+{
+		if (bucket < (1 << STATS_SUB_BITS))
+				return bucket;
+		int exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+		uint64_t sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+		return ((1 << STATS_SUB_BITS) + sub) << (exponent - STATS_SUB_BITS);
+}
+
+
+/* Adds <uint64_t value> to the histogram <struct histogram *h> */
+void histogram_add(struct histogram *h, uint64_t value)
+{
+		if (h->count == 0 || value < h->min)
+				h->min = value;
+		if (value > h->max)
+				h->max = value;
+		h->count++;
+		h->sum += value;
+		h->buckets[histogram_bucket(value)]++;
+}
+
+
+/*
+ * Returns the lowest value of the bucket holding the value below which
+ * <double fraction> of the values in <struct histogram *h> lie.
+ */
+uint64_t histogram_percentile(struct histogram *h, double fraction)
+{
+		uint64_t rank = (uint64_t) (fraction * h->count);
+		uint64_t seen = 0;
+		for (int i = 0; i < STATS_BUCKETS; i++) {
+				seen += h->buckets[i];
+				if (seen > rank)
+						return histogram_bucket_low(i);
+		}
+		return h->max;
+}
+
+
+/*
+ * Writes <struct histogram *h> as the JSON member <const char *name> to
+ * <FILE *fh>: summary values, and [lowest value, count] of every bucket
+ * in use.
+ */
+void histogram_write_json(FILE *fh, const char *name, struct histogram *h)
+{
+		fprintf(fh, "\"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"mean\": %.1f",
+				name, h->count, h->min, h->max, h->count ? (double) h->sum / h->count : 0.0);
+		fprintf(fh, ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"buckets\": [",
+				histogram_percentile(h, 0.5), histogram_percentile(h, 0.9),
+				histogram_percentile(h, 0.99), histogram_percentile(h, 0.999));
+		const char *separator = "";
+		for (int i = 0; i < STATS_BUCKETS; i++) {
+				if (h->buckets[i]) {
+						fprintf(fh, "%s[%" PRIu64 ", %" PRIu64 "]", separator, histogram_bucket_low(i), h->buckets[i]);
+						separator = ", ";
+				}
+		}
+		fputs("]}", fh);
+}
+
+
+/* Records a command of <enum command_kind kind> which took <uint64_t ns> */
+void stats_record_command(enum command_kind kind, uint64_t ns, int failed)
+{
+		histogram_add(&stats.latency[kind], ns);
+		if (failed)
+				stats.failures[kind]++;
+}
+
+
+/*
+ * Records the read-only command <struct read_job *job> after it has run.
+ * A nonexistent router counts as a failure; a path query also records
+ * the routers expanded to answer it and the length of the path.
+ */
+void stats_record_job(struct read_job *job)
+{
+		stats_record_command(job->command, job->plan_ns + job->run_ns, job->kind == JOB_INVALID);
+		if (job->command == CMD_FINNES_RUTE && job->kind != JOB_INVALID) {
+				histogram_add(&stats.visited, job->visited);
+				histogram_add(&stats.path_length, job->path_len);
+		}
+}
+
+
+/*
+ * Writes the statistics of the run as JSON to stats.file.
+ * Returns SUCCESS, or FAILURE (after printing an error) if it could not.
+ */
+int stats_write()
+{
+		static const char *command_names[N_COMMAND_KINDS] = {
+				"invalid", "print", "sett_flag", "sett_modell",
+				"legg_til_kobling", "slett_router", "finnes_rute", "scc_indeks"
+		};
+		static const char *phase_names[N_PHASES] = { "load", "commands", "path_batches", "write" };
+
+		FILE *fh = fopen(stats.file, "w");
+		if (!(fh)) {
+				fprintf(stderr, "%sError%s when trying to open file called '%s':\n      ", CLR_RED, CLR_NRM, stats.file);
+				perror("");
+				return FAILURE;
+		}
+		fputs("{\n  \"phases_ns\": {", fh);
+		for (int p = 0; p < N_PHASES; p++)
+				fprintf(fh, "%s\"%s\": %" PRIu64, p ? ", " : "", phase_names[p], stats.phase_ns[p]);
+		fputs("},\n  \"commands\": {", fh);
+		for (int k = 0; k < N_COMMAND_KINDS; k++) {
+				fprintf(fh, "%s\n    \"%s\": {\"failures\": %" PRIu64 ", ", k ? "," : "", command_names[k], stats.failures[k]);
+				histogram_write_json(fh, "latency_ns", &stats.latency[k]);
+				if (k == CMD_FINNES_RUTE) {
+						fputs(",\n      ", fh);
+						histogram_write_json(fh, "visited", &stats.visited);
+						fputs(",\n      ", fh);
+						histogram_write_json(fh, "path_length", &stats.path_length);
+				}
+				fputs("}", fh);
+		}
+		fputs("\n  }\n}\n", fh);
+		if (ferror(fh) | fclose(fh)) {
+				fprintf(stderr, "%sError%s when writing '%s'\n", CLR_RED, CLR_NRM, stats.file);
+				return FAILURE;
+		}
+		return SUCCESS;
+}
+
+
+
+/* --- DAEMON FUNCTIONS --- */
+
+/*
+ * Serves commands on the Unix domain socket <char socket_name[]> until a
+ * client sends 'avslutt' or the process gets SIGINT or SIGTERM. Each client
+ * is served by its own thread, one command per line, and every reply ends
+ * with a line holding only SERVER_REPLY_END. 'lagre' saves the routers to
+ * <char router_name[]> (or syncs the journal, with option -j).
+ * Returns SUCCESS, or FAILURE (after printing an error) if the socket could
+ * not be set up.
+ */
+int run_server(char socket_name[], char router_name[])
+{
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+				fprintf(stderr, "%sError%s: socket name '%s' is too long\n", CLR_RED, CLR_NRM, socket_name);
+				return FAILURE;
+		}
+		strcpy(addr.sun_path, socket_name);
+
+		/* A socket left behind by an earlier daemon is replaced */
+		struct stat st;
+		if (stat(socket_name, &st) == 0 && S_ISSOCK(st.st_mode))
+				unlink(socket_name);
+		server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (server.listen_fd == -1 || bind(server.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+			|| listen(server.listen_fd, SOMAXCONN) != 0) {
+				fprintf(stderr, "%sError%s when trying to listen on socket '%s':\n      ", CLR_RED, CLR_NRM, socket_name);
+				perror("");
+				if (server.listen_fd != -1)
+						close(server.listen_fd);
+				return FAILURE;
+		}
+		server.router_name = router_name;
+		for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+				server.clients[i] = -1;
+		if (snapshot_init() != SUCCESS) {
+				close(server.listen_fd);
+				server.listen_fd = -1;
+				unlink(socket_name);
+				return FAILURE;
+		}
+		int log_fd = dup(STDERR_FILENO);
+		server.log = log_fd == -1 ? NULL : fdopen(log_fd, "w");
+		if (!(server.log)) {
+				perror("Error with fdopen");
+				if (log_fd != -1)
+						close(log_fd);
+				snapshot_free();
+				close(server.listen_fd);
+				server.listen_fd = -1;
+				unlink(socket_name);
+				return FAILURE;
+		}
+		setvbuf(server.log, NULL, _IONBF, 0);
+
+		/* Stop on SIGINT and SIGTERM. They stay blocked in every thread, and
+		 * are only let through while this thread waits in pselect() below, so
+		 * one coming between the check of server_signalled and the wait is
+		 * not lost. The socket does not block, in case a client is gone
+		 * before accept() */
+		struct sigaction sa = { .sa_handler = server_signal };
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		signal(SIGPIPE, SIG_IGN);
+		sigset_t blocked, old, waiting;
+		sigemptyset(&blocked);
+		sigaddset(&blocked, SIGINT);
+		sigaddset(&blocked, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &blocked, &old);
+		waiting = old;
+		sigdelset(&waiting, SIGINT);
+		sigdelset(&waiting, SIGTERM);
+		fcntl(server.listen_fd, F_SETFL, fcntl(server.listen_fd, F_GETFL) | O_NONBLOCK);
+		printf("Serving commands on '%s'\n", socket_name);
+		fflush(stdout);
+
+		while (!(server.stopping) && !(server_signalled)) {
+				fd_set ready;
+				FD_ZERO(&ready);
+				FD_SET(server.listen_fd, &ready);
+				if (pselect(server.listen_fd + 1, &ready, NULL, NULL, NULL, &waiting) == -1) {
+						if (errno == EINTR)
+								continue;
+						fprintf(server.log, "Error with pselect: %s\n", strerror(errno));
+						break;
+				}
+				int fd = accept(server.listen_fd, NULL, NULL);
+				if (fd == -1) {
+						if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED
+							&& !(server.stopping))
+								fprintf(server.log, "Error with accept: %s\n", strerror(errno));
+						if (errno == EBADF || errno == EINVAL)
+								break;
+						continue;
+				}
+				pthread_mutex_lock(&server.clients_lock);
+				int slot = 0;
+				while (slot < SERVER_MAX_CLIENTS && server.clients[slot] != -1)
+						slot++;
+				if (slot < SERVER_MAX_CLIENTS) {
+						server.clients[slot] = fd;
+						server.n_clients++;
+				}
+				pthread_mutex_unlock(&server.clients_lock);
+				if (slot == SERVER_MAX_CLIENTS) {
+						fprintf(server.log, "%sWarning%s: more than %d clients, closing connection\n", CLR_RED, CLR_NRM, SERVER_MAX_CLIENTS);
+						close(fd);
+						continue;
+				}
+
+				/* The thread gets the mask of this one, with the signals blocked */
+				pthread_t thread;
+				int started = pthread_create(&thread, NULL, server_client, (void *) (intptr_t) slot);
+				if (started != 0) {
+						fprintf(server.log, "%sWarning%s: could not start a thread for a client\n", CLR_RED, CLR_NRM);
+						server_client_done(slot);
+				} else {
+						pthread_detach(thread);
+				}
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		/* Disconnect the clients, and wait for their threads to finish */
+		pthread_mutex_lock(&server.lock);
+		close(server.listen_fd);
+		server.listen_fd = -1;
+		server.stopping = TRUE;
+		pthread_mutex_unlock(&server.lock);
+		unlink(socket_name);
+		pthread_mutex_lock(&server.clients_lock);
+		for (int i = 0; i < SERVER_MAX_CLIENTS; i++)
+				if (server.clients[i] != -1)
+						shutdown(server.clients[i], SHUT_RDWR);
+		while (server.n_clients > 0)
+				pthread_cond_wait(&server.clients_done, &server.clients_lock);
+		pthread_mutex_unlock(&server.clients_lock);
+		snapshot_free();
+		fclose(server.log);
+		server.log = NULL;
+		return SUCCESS;
+}
+
+
+/* Handler of SIGINT and SIGTERM in daemon mode */
+void server_signal(int signum)
+{
+		(void) signum;
+		server_signalled = TRUE;
+}
+
+
+/*
+ * Thread serving the client in slot <void *arg> of server.clients.
+ * Reads one command per line until the client disconnects.
+ */
+void *server_client(void *arg)
+{
+		int slot = (intptr_t) arg;
+		int fd = server.clients[slot];
+		int out_fd = dup(fd);
+		FILE *in = fdopen(fd, "r");
+		FILE *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+		if (!(in) || !(out)) {
+				fprintf(server.log, "Error with fdopen: %s\n", strerror(errno));
+				if (out)
+						fclose(out);
+				else if (out_fd != -1)
+						close(out_fd);
+				if (in)
+						fclose(in);
+				server_client_done(slot);
+				return NULL;
+		}
+
+		struct search_scratch s;
+		memset(&s, 0, sizeof(struct search_scratch));
+		char *line = NULL;
+		size_t line_cap = 0;
+		ssize_t len;
+		int stop = FALSE;
+		while (!(stop) && (len = getline(&line, &line_cap, in)) > 0) {
+				if (line[len - 1] == '\n')
+						len--;
+				struct command cmd;
+				parse_command(line, len, &cmd);
+				if (server_read_command(&cmd, &s, out) != SUCCESS)
+						stop = server_command(&cmd, fd, out) != SUCCESS;
+				fprintf(out, "%s\n", SERVER_REPLY_END);
+				if (fflush(out) != 0)
+						break;
+		}
+
+		free(line);
+		scratch_free(&s);
+		fclose(out);
+		fclose(in);
+		server_client_done(slot);
+		return NULL;
+}
+
+
+/* Frees slot <int slot> of server.clients when its client is gone */
+void server_client_done(int slot)
+{
+		pthread_mutex_lock(&server.clients_lock);
+		server.clients[slot] = -1;
+		if (--server.n_clients == 0)
+				pthread_cond_signal(&server.clients_done);
+		pthread_mutex_unlock(&server.clients_lock);
+}
+
+
+/*
+ * Runs <struct command *cmd> if it only reads the graph ('print' or
+ * 'finnes_rute' on existing routers), printing to <FILE *out>. Runs on the
+ * current snapshot without taking the server lock, so reads never wait for
+ * changes. Searches use the scratch space <struct search_scratch *s> of the
+ * client, and neither the reachability cache nor the SCC index, which
+ * belong to the live graph.
+ * Returns SUCCESS, or FAILURE if the command must go to server_command().
+ */
+int server_read_command(struct command *cmd, struct search_scratch *s, FILE *out)
+{
+		if (!((cmd->kind == CMD_PRINT && cmd->n_args >= 1) || (cmd->kind == CMD_FINNES_RUTE && cmd->n_args >= 2)))
+				return FAILURE;
+
+		/* The scratch space is grown with the server lock held, while stderr
+		 * is not pointed at another client. No routers are added, so the
+		 * searches below need no more */
+		if (s->capacity < N) {
+				pthread_mutex_lock(&server.lock);
+				int reserved = scratch_reserve(s, N);
+				pthread_mutex_unlock(&server.lock);
+				if (reserved != SUCCESS)
+						return FAILURE;
+		}
+
+		struct snapshot *g = snapshot_acquire();
+		struct read_job job = { .kind = JOB_PRINT, .fromID = cmd->args[0], .toID = cmd->args[1] };
+		job.from_slot = snapshot_lookup(g, job.fromID);
+		job.to_slot = cmd->kind == CMD_PRINT ? job.from_slot : snapshot_lookup(g, job.toID);
+		if (job.from_slot == INDEX_EMPTY || job.to_slot == INDEX_EMPTY) {
+				snapshot_release(g);
+				return FAILURE;
+		}
+		if (cmd->kind == CMD_FINNES_RUTE)
+				job.kind = JOB_SEARCH;
+		s->snapshot = g;
+		run_job(&job, s, out);
+		s->snapshot = NULL;
+		snapshot_release(g);
+		return SUCCESS;
+}
+
+
+/*
+ * Runs <struct command *cmd> with the server lock held, and stdout and
+ * stderr pointed at the client socket <int fd>, so the client sees the same
+ * output as from a commands-file. Also runs the daemon commands 'lagre'
+ * and 'avslutt'. Changes are published as a new snapshot before the lock
+ * is let go, so the next read of any client sees them. Meanwhile the other
+ * threads write their errors and warnings to server.log.
+ * Returns SUCCESS, or FAILURE if the client asked the daemon to stop.
+ */
+int server_command(struct command *cmd, int fd, FILE *out)
+{
+		int result = SUCCESS;
+		fflush(out);
+		pthread_mutex_lock(&server.lock);
+		fflush(stdout);
+		fflush(stderr);
+		int saved_out = dup(STDOUT_FILENO);
+		int saved_err = dup(STDERR_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+
+		if (cmd->kind == CMD_INVALID && cmd->keyword_len == 5 && memcmp(cmd->keyword, "lagre", 5) == 0) {
+				if (journal.enabled) {
+						if (journal_sync() == SUCCESS)
+								puts("Changes written to the journal");
+				} else if (save_router_file(server.router_name) == SUCCESS) {
+						journal_discard();
+						printf("Routers written to '%s'\n", server.router_name);
+				}
+		} else if (cmd->kind == CMD_INVALID && cmd->keyword_len == 7 && memcmp(cmd->keyword, "avslutt", 7) == 0) {
+				server.stopping = TRUE;
+				if (server.listen_fd != -1)
+						shutdown(server.listen_fd, SHUT_RDWR);
+				puts("Stopping");
+				result = FAILURE;
+		} else {
+				/* An invalid command only stops the commands-file, not the daemon */
+				execute_command(cmd);
+				snapshot_publish();
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		dup2(saved_out, STDOUT_FILENO);
+		dup2(saved_err, STDERR_FILENO);
+		close(saved_out);
+		close(saved_err);
+		pthread_mutex_unlock(&server.lock);
+		return result;
+}
+
+
+
+/* --- SNAPSHOT FUNCTIONS --- */
+
+/*
+ * Starts taking snapshots of the graph for the daemon: copies the router
+ * index and makes the first version, with a page for every
+ * SNAPSHOT_PAGE_SLOTS slots of router_array.
+ * Returns SUCCESS, or FAILURE (after printing an error) if out of memory.
+ */
+int snapshot_init()
+{
+		int n_pages = (N + SNAPSHOT_PAGE_SLOTS - 1) / SNAPSHOT_PAGE_SLOTS;
+		snapshots.index = router_index;
+		snapshots.index.keys = malloc(sizeof(unsigned int) * router_index.capacity);
+		snapshots.index.slots = malloc(sizeof(int) * router_index.capacity);
+		snapshots.dirty = calloc(n_pages ? n_pages : 1, 1);
+		struct snapshot *g = malloc(sizeof(struct snapshot) + sizeof(struct snapshot_page *) * n_pages);
+		if (!(snapshots.index.keys) || !(snapshots.index.slots) || !(snapshots.dirty) || !(g)) {
+				perror("Error with malloc");
+				free(g);
+				snapshot_free();
+				return FAILURE;
+		}
+		memcpy(snapshots.index.keys, router_index.keys, sizeof(unsigned int) * router_index.capacity);
+		memcpy(snapshots.index.slots, router_index.slots, sizeof(int) * router_index.capacity);
+
+		atomic_init(&g->refs, 1);
+		g->n_routers = N_ROUTERS;
+		g->n_pages = n_pages;
+		for (int p = 0; p < n_pages; p++) {
+				g->pages[p] = snapshot_build_page(p, NULL, SNAPSHOT_GRAPH | SNAPSHOT_DESC);
+				if (!(g->pages[p])) {
+						g->n_pages = p;
+						snapshot_release(g);
+						snapshot_free();
+						return FAILURE;
+				}
+		}
+		snapshots.current = g;
+		snapshots.enabled = TRUE;
+		return SUCCESS;
+}
+
+
+/*
+ * Marks the page of the router in <int slot> as changed in <int what>
+ * (SNAPSHOT_GRAPH or SNAPSHOT_DESC), so the next snapshot copies it.
+ * Does nothing unless the daemon takes snapshots.
+ */
+void snapshot_touch(int slot, int what)
+{
+		if (!(snapshots.enabled))
+				return;
+		snapshots.dirty[slot / SNAPSHOT_PAGE_SLOTS] |= what;
+		snapshots.any_dirty = TRUE;
+}
+
+
+/*
+ * Makes page <int page> of a new snapshot from the live graph. The
+ * descriptions are shared with <struct snapshot_page *old> unless <int what>
+ * has SNAPSHOT_DESC.
+ * Returns the page, or NULL (after printing an error) if out of memory.
+ */
+struct snapshot_page *snapshot_build_page(int page, struct snapshot_page *old, int what)
+{
+		int first = page * SNAPSHOT_PAGE_SLOTS;
+		int end = first + SNAPSHOT_PAGE_SLOTS < N ? first + SNAPSHOT_PAGE_SLOTS : N;
+		size_t total = 0;
+		for (int slot = first; slot < end; slot++)
+				if (router_array[slot])
+						total += router_array[slot]->n_conn + router_array[slot]->n_incoming;
+
+		struct snapshot_page *pg = calloc(1, sizeof(struct snapshot_page));
+		int *conn = malloc(sizeof(int) * (total ? total : 1));
+		int shared = old && !(what & SNAPSHOT_DESC);
+		struct snapshot_desc *desc = shared ? old->desc : malloc(sizeof(struct snapshot_desc));
+		if (!(pg) || !(conn) || !(desc)) {
+				perror("Error with malloc");
+				free(pg);
+				free(conn);
+				if (!(shared))
+						free(desc);
+				return NULL;
+		}
+		if (shared) {
+				atomic_fetch_add(&desc->refs, 1);
+		} else {
+				atomic_init(&desc->refs, 1);
+				memset(desc->desc, 0, sizeof(desc->desc));
+				memcpy(desc->desc, desc_store + first, sizeof(struct router_desc) * (end - first));
+		}
+
+		/* Rows of connections first, then the incoming connections */
+		atomic_init(&pg->refs, 1);
+		pg->conn = conn;
+		pg->desc = desc;
+		size_t pos = 0;
+		struct router *r;
+		for (int i = 0; i < SNAPSHOT_PAGE_SLOTS; i++) {
+				pg->conn_start[i] = pos;
+				r = first + i < end ? router_array[first + i] : NULL;
+				if (!(r))
+						continue;
+				pg->present[i] = TRUE;
+				pg->flag[i] = r->flag;
+				pg->routerID[i] = r->routerID;
+				memcpy(conn + pos, adjacency.target + r->conn_start, sizeof(int) * r->n_conn);
+				pos += r->n_conn;
+		}
+		pg->conn_start[SNAPSHOT_PAGE_SLOTS] = pos;
+		for (int i = 0; i < SNAPSHOT_PAGE_SLOTS; i++) {
+				pg->in_start[i] = pos;
+				r = first + i < end ? router_array[first + i] : NULL;
+				if (!(r))
+						continue;
+				for (int j = 0; j < r->n_incoming; j++)
+						conn[pos++] = r->incoming[j]->slot;
+		}
+		pg->in_start[SNAPSHOT_PAGE_SLOTS] = pos;
+		return pg;
+}
+
+
+/*
+ * Makes a new version of the graph from the current one, copying only the
+ * pages changed since it was made, and makes it current. Readers still on
+ * the old version keep it until they release it. Called by the writer
+ * after each change.
+ * Returns SUCCESS, or FAILURE (after printing an error) if out of memory,
+ * in which case readers see the old version until the next call.
+ */
+int snapshot_publish()
+{
+		if (!(snapshots.enabled) || !(snapshots.any_dirty))
+				return SUCCESS;
+
+		struct snapshot *old = snapshots.current;
+		struct snapshot *g = malloc(sizeof(struct snapshot) + sizeof(struct snapshot_page *) * old->n_pages);
+		if (!(g)) {
+				perror("Error with malloc");
+				return FAILURE;
+		}
+		atomic_init(&g->refs, 1);
+		g->n_routers = N_ROUTERS;
+		g->n_pages = old->n_pages;
+		for (int p = 0; p < old->n_pages; p++) {
+				if (!(snapshots.dirty[p])) {
+						g->pages[p] = old->pages[p];
+						atomic_fetch_add(&g->pages[p]->refs, 1);
+						continue;
+				}
+				g->pages[p] = snapshot_build_page(p, old->pages[p], snapshots.dirty[p]);
+				if (!(g->pages[p])) {
+						g->n_pages = p;
+						snapshot_release(g);
+						return FAILURE;
+				}
+		}
+		memset(snapshots.dirty, 0, old->n_pages);
+		snapshots.any_dirty = FALSE;
+
+		pthread_mutex_lock(&snapshots.lock);
+		snapshots.current = g;
+		pthread_mutex_unlock(&snapshots.lock);
+		snapshot_release(old);
+		return SUCCESS;
+}
+
+
+/*
+ * Returns the current version of the graph, which stays valid until it is
+ * given to snapshot_release().
+ */
+struct snapshot *snapshot_acquire()
+{
+		pthread_mutex_lock(&snapshots.lock);
+		struct snapshot *g = snapshots.current;
+		atomic_fetch_add(&g->refs, 1);
+		pthread_mutex_unlock(&snapshots.lock);
+		return g;
+}
+
+
+/* Lets go of <struct snapshot *g>, freeing it and its pages not shared with a newer version */
+void snapshot_release(struct snapshot *g)
+{
+		if (atomic_fetch_sub(&g->refs, 1) != 1)
+				return;
+		for (int p = 0; p < g->n_pages; p++)
+				snapshot_page_release(g->pages[p]);
+		free(g);
+}
+
+
+/* Lets go of <struct snapshot_page *page>, freeing it when no snapshot has it */
+void snapshot_page_release(struct snapshot_page *page)
+{
+		if (atomic_fetch_sub(&page->refs, 1) != 1)
+				return;
+		if (atomic_fetch_sub(&page->desc->refs, 1) == 1)
+				free(page->desc);
+		free(page->conn);
+		free(page);
+}
+
+
+/*
+ * Returns the slot of router with <unsigned int routerID> in
+ * <struct snapshot *g>, or INDEX_EMPTY if it has no such router.
+ */
+int snapshot_lookup(struct snapshot *g, unsigned int routerID)
+{
+		struct router_index *index = &snapshots.index;
+		unsigned int mask = index->capacity - 1;
+		unsigned int i = (unsigned int) (routerID * INDEX_HASH_MUL) >> index->shift;
+		while (index->slots[i] != INDEX_EMPTY) {
+				if (index->keys[i] == routerID) {
+						int slot = index->slots[i];
+						struct snapshot_page *page = g->pages[slot / SNAPSHOT_PAGE_SLOTS];
+						return page->present[slot % SNAPSHOT_PAGE_SLOTS] ? slot : INDEX_EMPTY;
+				}
+				i = (i + 1) & mask;
+		}
+		return INDEX_EMPTY;
+}
+
+
+/* Points <const int **conn> at the connections (slots) of router in <int slot> of <struct snapshot *g>, and returns their number */
+int snapshot_connections(struct snapshot *g, int slot, const int **conn)
+{
+		struct snapshot_page *page = g->pages[slot / SNAPSHOT_PAGE_SLOTS];
+		int i = slot % SNAPSHOT_PAGE_SLOTS;
+		*conn = page->conn + page->conn_start[i];
+		return page->conn_start[i + 1] - page->conn_start[i];
+}
+
+
+/* Points <const int **in> at the incoming connections (slots) of router in <int slot> of <struct snapshot *g>, and returns their number */
+int snapshot_incoming(struct snapshot *g, int slot, const int **in)
+{
+		struct snapshot_page *page = g->pages[slot / SNAPSHOT_PAGE_SLOTS];
+		int i = slot % SNAPSHOT_PAGE_SLOTS;
+		*in = page->conn + page->in_start[i];
+		return page->in_start[i + 1] - page->in_start[i];
+}
+
+
+/* Stops taking snapshots, and frees the current version and the copy of the index */
+void snapshot_free()
+{
+		if (snapshots.current)
+				snapshot_release(snapshots.current);
+		snapshots.current = NULL;
+		free(snapshots.dirty);
+		free(snapshots.index.keys);
+		free(snapshots.index.slots);
+		snapshots.dirty = NULL;
+		snapshots.index.keys = NULL;
+		snapshots.index.slots = NULL;
+		snapshots.enabled = FALSE;
+		snapshots.any_dirty = FALSE;
+}
+
+
+/* Returns the ID of router in <int slot> of graph <struct snapshot *g> (the live graph if NULL) */
+unsigned int graph_router_id(struct snapshot *g, int slot)
+{
+		if (!(g))
+				return router_array[slot]->routerID;
+		return g->pages[slot / SNAPSHOT_PAGE_SLOTS]->routerID[slot % SNAPSHOT_PAGE_SLOTS];
+}
+
+
+/* Fills <struct router_view *v> with router in <int slot> of graph <struct snapshot *g> (the live graph if NULL) */
+void graph_router(struct snapshot *g, int slot, struct router_view *v)
+{
+		if (!(g)) {
+				struct router *r = router_array[slot];
+				v->routerID = r->routerID;
+				v->flag = r->flag;
+				v->desc = &desc_store[slot];
+				v->conn = adjacency.target + r->conn_start;
+				v->n_conn = r->n_conn;
+				return;
+		}
+		struct snapshot_page *page = g->pages[slot / SNAPSHOT_PAGE_SLOTS];
+		int i = slot % SNAPSHOT_PAGE_SLOTS;
+		v->routerID = page->routerID[i];
+		v->flag = page->flag[i];
+		v->desc = &page->desc->desc[i];
+		v->conn = page->conn + page->conn_start[i];
+		v->n_conn = page->conn_start[i + 1] - page->conn_start[i];
+}
+
+
+
+/* --- REACHABILITY INDEX FUNCTIONS --- */
+
+/*
+ * Iterative version of Tarjan's algorithm over all routers in router_array.
+ * Writes the component number of each slot to <int *component> (-1 for empty
+ * slots), and fills in number of components, cyclic flags and largest size
+ * in the global scc_index. Returns SUCCESS, or FAILURE on allocation failure.
+ */
+int scc_tarjan(int *component)
+{
+		int *order = malloc(sizeof(int) * N);      /* DFS number of each slot, -1 if unvisited */
+		int *lowlink = malloc(sizeof(int) * N);
+		int *stack = malloc(sizeof(int) * N);      /* Tarjan's stack of slots */
+		int *call = malloc(sizeof(int) * N);       /* Explicit DFS call stack */
+		int *edge = malloc(sizeof(int) * N);       /* Next connection to try for each frame */
+		unsigned char *cyclic = malloc(N > 0 ? N : 1);
+		if (!(order) || !(lowlink) || !(stack) || !(call) || !(edge) || !(cyclic)) {
+				perror("Error with malloc");
+				free(order); free(lowlink); free(stack); free(call); free(edge); free(cyclic);
+				return FAILURE;
+		}
 
-		if (!command)
-				return CRITICAL_FAILURE;
+		for (int i = 0; i < N; i++) {
+				order[i] = -1;
+				component[i] = -1;
+		}
+		int counter = 0, sp = 0, n_components = 0, largest = 0;
+		for (int root = 0; root < N; root++) {
+				if (!(router_array[root]) || order[root] != -1)
+						continue;
+
+				int depth = 0;
+				call[depth] = root;
+				edge[depth] = 0;
+				order[root] = lowlink[root] = counter++;
+				stack[sp++] = root;
+				while (depth >= 0) {
+						int cur = call[depth];
+						struct router *r = router_array[cur];
+						if (edge[depth] < r->n_conn) {
+								int next = adjacency.target[r->conn_start + edge[depth]++];
+								if (order[next] == -1) {
+										/* Descend into unvisited router */
+										depth++;
+										call[depth] = next;
+										edge[depth] = 0;
+										order[next] = lowlink[next] = counter++;
+										stack[sp++] = next;
+								} else if (component[next] == -1 && order[next] < lowlink[cur]) {
+										/* Router still on stack, part of current component */
+										lowlink[cur] = order[next];
+								}
+								continue;
+						}
 
-		if (strcmp(command, "print") == 0) {
-				routerID = atoi(strtok(NULL, " "));
-				if (!(get_router(routerID))) {
-						print_invalid_routerID(routerID);
-						succeeded = FAILURE;
-				} else {
-						printf("\nInformation – Router %d:\n", routerID);
-						print_router_data(get_router(routerID));
+						/* All connections done: pop a component if cur is its root */
+						if (lowlink[cur] == order[cur]) {
+								int size = 0;
+								int member;
+								do {
+										member = stack[--sp];
+										component[member] = n_components;
+										size++;
+								} while (member != cur);
+								cyclic[n_components] = size > 1 || is_connected(r, r->routerID);
+								if (size > largest)
+										largest = size;
+								n_components++;
+						}
+						depth--;
+						if (depth >= 0 && lowlink[cur] < lowlink[call[depth]])
+								lowlink[call[depth]] = lowlink[cur];
 				}
+		}
 
-		} else if (strcmp(command, "sett_flag") == 0) {
-				routerID = atoi(strtok(NULL, " "));
-				flag = atoi(strtok(NULL, " "));
-				val = atoi(strtok(NULL, " "));
-				if (!(get_router(routerID))) {
-						print_invalid_routerID(routerID);
-						succeeded = FAILURE;
-				} else {
-						/* printf("\nSetting flag – router: %d, flag: 0x%x, changing to: 0x%x\n", routerID, flag, val); */
-						succeeded = set_flag(routerID, flag, val);
-				}
+		free(order); free(lowlink); free(stack); free(call); free(edge);
+		free(scc_index.cyclic);
+		scc_index.cyclic = cyclic;
+		scc_index.n_components = n_components;
+		scc_index.largest = largest;
+		return SUCCESS;
+}
 
-		} else if (strcmp(line, "sett_modell") == 0) {
-				routerID = atoi(strtok(NULL, " "));
-				if (!(get_router(routerID))) {
-						print_invalid_routerID(routerID);
-						succeeded = FAILURE;
-				} else {
-						desc = strtok(NULL, "\n");
-						/* printf("\nSetting model – id: %d, new description: %s\n", routerID, desc); */
-						succeeded = set_model(routerID, desc);
-				}
 
-		} else if (strcmp(line, "legg_til_kobling") == 0) {
-				fromID = atoi(strtok(NULL, " "));
-				toID = atoi(strtok(NULL, " "));
-				if (!(get_router(fromID))) {
-						print_invalid_routerID(fromID);
-						succeeded = FAILURE;
-				} else if (!(get_router(toID))) {
-						print_invalid_routerID(toID);
-						succeeded = FAILURE;
-				} else {
-						/* printf("\nAdding connection – from %d to %d\n", fromID, toID); */
-						succeeded = add_connection(fromID, toID);
-				}
+/*
+ * Computes the interval labels of all components, and the exact reachability
+ * bitsets when there are at most SCC_BITSET_MAX_COMPONENTS components.
+ * Components are visited in increasing number, so all components reachable
+ * from a component are finished before the component itself.
+ */
+int scc_build_labels()
+{
+		int C = scc_index.n_components;
+		int *low = malloc(sizeof(int) * (C > 0 ? C : 1));
+		int *first = malloc(sizeof(int) * (C + 1));  /* Routers grouped by component */
+		int *members = malloc(sizeof(int) * (N > 0 ? N : 1));
+		if (!(low) || !(first) || !(members)) {
+				perror("Error with malloc");
+				free(low); free(first); free(members);
+				return FAILURE;
+		}
 
-		} else if (strcmp(line, "slett_router") == 0) {
-				routerID = atoi(strtok(NULL, " "));
-				if (!(get_router(routerID))) {
-						print_invalid_routerID(routerID);
-						succeeded = FAILURE;
-				} else {
-						/* printf("\nRemoving – router with id: %d\n", routerID); */
-						succeeded = remove_router(routerID);
-				}
+		/* Counting sort of slots by component. Filling advances first[c]
+		 * to the start of c + 1, so it is shifted back afterwards. */
+		memset(first, 0, sizeof(int) * (C + 1));
+		for (int i = 0; i < N; i++) {
+				if (router_array[i])
+						first[scc_index.component[i] + 1]++;
+		}
+		for (int c = 0; c < C; c++)
+				first[c + 1] += first[c];
+		for (int i = 0; i < N; i++) {
+				if (router_array[i])
+						members[first[scc_index.component[i]]++] = i;
+		}
+		for (int c = C; c > 0; c--)
+				first[c] = first[c - 1];
+		first[0] = 0;
+
+		free(scc_index.reach);
+		scc_index.reach = NULL;
+		scc_index.words = (C + 63) / 64;
+		if (C <= SCC_BITSET_MAX_COMPONENTS) {
+				scc_index.reach = calloc((size_t) C * scc_index.words + 1, sizeof(uint64_t));
+				if (!(scc_index.reach))
+						perror("Error with calloc");
+		}
 
-		} else if (strcmp(line, "finnes_rute") == 0) {
-				fromID = atoi(strtok(NULL, " "));
-				toID = atoi(strtok(NULL, " "));
-				if (!(get_router(fromID))) {
-						print_invalid_routerID(fromID);
-						succeeded = FAILURE;
-				} else if (!(get_router(toID))) {
-						print_invalid_routerID(toID);
-						succeeded = FAILURE;
-				} else {
-						/* printf("\nLooking for a path – from %d to %d\n", fromID, toID); */
-						succeeded = exists_path(fromID, toID);
+		uint64_t *reach = scc_index.reach;
+		int words = scc_index.words;
+		for (int c = 0; c < C; c++) {
+				low[c] = c;
+				for (int m = first[c]; m < first[c + 1]; m++) {
+						struct router *r = router_array[members[m]];
+						int *conn = adjacency.target + r->conn_start;
+						for (int i = 0; i < r->n_conn; i++) {
+								int d = scc_index.component[conn[i]];
+								if (d == c)
+										continue;
+								if (low[d] < low[c])
+										low[c] = low[d];
+								if (reach) {
+										uint64_t *dst = reach + (size_t) c * words;
+										uint64_t *src = reach + (size_t) d * words;
+										for (int w = 0; w < words; w++)
+												dst[w] |= src[w];
+										dst[d / 64] |= (uint64_t) 1 << (d % 64);
+								}
+						}
 				}
-
-		} else {
-				fprintf(stderr, "%sWarning:%s '%s' is not a valid command\n", CLR_RED, CLR_NRM, command);
-				fprintf(stderr, "Check for a possible empty line in commands-file\n");
-				return CRITICAL_FAILURE;
 		}
 
-		if (!(succeeded == 0)) {
-				/* fprintf(stderr, "%sWarning:%s something went wrong during execution of a command.\n", CLR_RED, CLR_NRM); */
+		free(scc_index.first);
+		free(scc_index.members);
+		free(scc_index.low);
+		scc_index.first = first;
+		scc_index.members = members;
+		scc_index.low = low;
+		return SUCCESS;
+}
+
+
+/*
+ * (Re)builds the SCC index for the current graph.
+ * Returns SUCCESS, or FAILURE on allocation failure.
+ */
+int scc_build()
+{
+		int *component = realloc(scc_index.component, sizeof(int) * (N > 0 ? N : 1));
+		if (!(component)) {
+				perror("Error with realloc");
 				return FAILURE;
 		}
+		scc_index.component = component;
+		scc_index.built = FALSE;
+
+		if (scc_tarjan(component) != SUCCESS || scc_build_labels() != SUCCESS)
+				return FAILURE;
 
+		scc_index.epoch = graph_epoch;
+		scc_index.built = TRUE;
 		return SUCCESS;
 }
 
 
+/* Rebuilds the SCC index if the graph has changed since it was built */
+int scc_ensure_built()
+{
+		if (scc_index.built && scc_index.epoch == graph_epoch)
+				return SUCCESS;
+		return scc_build();
+}
+
+
 /*
- * Executes all commands found in file given as argument <FILE *fh>,
- * by passing the read line from file to run_command();
- * Allocating memory for each line in file to be read to.
- * Worst case is a 'sett_modell'-command with id equal to biggest
- * possible unsigned int value (10 digits), with a string of size 248
- * (as from specification).
- * Function handles commando-files both with and without one trailing newline.
+ * Decides if router in <int to_slot> can be reached from router in
+ * <int from_slot> using the SCC index, which is rebuilt first if the graph
+ * has changed since it was built.
+ * Returns TRUE or FALSE, or SCC_UNKNOWN when a search is needed to tell.
  */
-int run_all_commands(FILE *fh)
+int scc_reachable(int from_slot, int to_slot)
 {
-		/* (See function description for details on this malloc-call)
-		 * Allocated memory is freed at end of this function
-		 * or during cleanup if an error should occur. */
-		int command_max_len = 272;
-		char *line = malloc(sizeof(char) * command_max_len);
-		char tmp = (char) fgetc(fh);
-		/* Check if file is empty, or if error on read */
-		if (tmp == EOF) {
-				if (error_flag_file(fh, "run_all_commands")) {
-						free(line);
-						return CRITICAL_FAILURE;
-				} else if (feof(fh)) {
-						fprintf(stderr, "%sWarning%s: Commands-file is empty.\n", CLR_RED, CLR_NRM);
-						free(line);
-						return FAILURE;
+		if (scc_ensure_built() != SUCCESS)
+				return SCC_UNKNOWN;
+
+		int a = scc_index.component[from_slot];
+		int b = scc_index.component[to_slot];
+		if (a == b)
+				return from_slot != to_slot || scc_index.cyclic[a];
+		if (b > a || b < scc_index.low[a])
+				return FALSE;
+		if (scc_index.reach)
+				return (scc_index.reach[(size_t) a * scc_index.words + b / 64] >> (b % 64)) & 1;
+		return SCC_UNKNOWN;
+}
+
+
+/* Prints information on the SCC index, used by command 'scc_indeks' */
+void scc_print_status()
+{
+		if (output_mode == OUTPUT_JSON) {
+				if (!(scc_index.built))
+						puts("{\"command\":\"scc_indeks\",\"built\":false}");
+				else
+						printf("{\"command\":\"scc_indeks\",\"built\":true,\"up_to_date\":%s,\"components\":%d,\"largest\":%d,\"reachability\":\"%s\"}\n",
+							scc_index.epoch == graph_epoch ? "true" : "false", scc_index.n_components, scc_index.largest,
+							scc_index.reach ? "bitsets" : "intervals");
+				return;
+		}
+		puts("\n- SCC index -");
+		if (!(scc_index.built)) {
+				printf("State:         not built\n");
+				return;
+		}
+		printf("State:         %s\n", scc_index.epoch == graph_epoch ? "up to date" : "stale, rebuilt on next search");
+		printf("Components:    %d (largest has %d routers)\n", scc_index.n_components, scc_index.largest);
+		printf("Reachability:  %s\n", scc_index.reach ? "exact bitsets" : "interval labels");
+}
+
+
+/* Free memory allocated to the SCC index */
+void scc_free()
+{
+		free(scc_index.component);
+		free(scc_index.members);
+		free(scc_index.first);
+		free(scc_index.low);
+		free(scc_index.cyclic);
+		free(scc_index.reach);
+		scc_index.component = NULL;
+		scc_index.members = NULL;
+		scc_index.first = NULL;
+		scc_index.low = NULL;
+		scc_index.cyclic = NULL;
+		scc_index.reach = NULL;
+		scc_index.built = FALSE;
+}
+
+
+/* --- VALIDATION FUNCTIONS --- */
+
+/*
+ * Checks the router file <char filename[]> against the file specification
+ * without loading it (option -V), and prints every problem found with its
+ * byte offset: information blocks that are too long or end past the end
+ * of the file, desc_len over DESC_MAX_LEN, duplicate router IDs, connection
+ * records with unknown routers, a missing 0-byte or cut short, duplicate
+ * connections, and routers with more than SPEC_MAX_CONNECTIONS connections.
+ * The connection section is checked by the worker pool.
+ * Problems are printed by kind, each kind in byte order: first those of the
+ * header and information blocks, then those of single connection records,
+ * then a record cut short, and last those of each router's connections,
+ * by the router's information block.
+ * Returns SUCCESS if no problems were found, FAILURE otherwise.
+ */
+int validate_router_file(char filename[])
+{
+		FILE *fh = open_file(filename, "rb");
+		if (!(fh))
+				return FAILURE;
+		struct validation *v = &validation;
+		struct stat st;
+		if (fstat(fileno(fh), &st) != 0 || !(S_ISREG(st.st_mode))) {
+				fprintf(stderr, "%sError%s: '%s' is not a regular file\n", CLR_RED, CLR_NRM, filename);
+				fclose(fh);
+				return FAILURE;
+		}
+		v->size = st.st_size;
+		if (v->size < sizeof(int)) {
+				printf("byte 0: file of %zu bytes is too short for the number of routers\n", v->size);
+				fclose(fh);
+				return FAILURE;
+		}
+		v->buf = mmap(NULL, v->size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+		fclose(fh);
+		if (v->buf == MAP_FAILED) {
+				perror("Error with mmap");
+				return FAILURE;
+		}
+
+		size_t pos;
+		size_t rest = 0;
+		int result = validate_routers(v, &pos);
+		if (result == SUCCESS) {
+				rest = v->size - pos;
+				v->records_start = pos;
+				v->n_records = (rest + 1) / CONNECTION_RECORD_SIZE;
+				if (v->n_records > UINT_MAX) {
+						fprintf(stderr, "%sError%s: too many connection records to check\n", CLR_RED, CLR_NRM);
+						result = FAILURE;
 				}
-		} else {
-				/* If not, unget fetched char */
-				ungetc(tmp, fh);
 		}
-		int result;
-		while (!(feof(fh))) {
-				fgets(line, command_max_len, fh);
-				if (error_flag_file(fh, "run_all_commands")) {
-						free(line);
-						return CRITICAL_FAILURE;
+		if (result == SUCCESS) {
+				v->n_chunks = (v->n_records + LOAD_CHUNK_RECORDS - 1) / LOAD_CHUNK_RECORDS;
+				int n_outputs = v->n_chunks > worker_pool.n_threads ? v->n_chunks : worker_pool.n_threads;
+				v->parallel = worker_pool.n_threads >= 2 && v->n_records >= 2 * LOAD_CHUNK_RECORDS && pool_start() == SUCCESS;
+				v->n_parts = v->parallel ? worker_pool.n_threads : 1;
+				v->from_slot = malloc(sizeof(int) * (v->n_records > 0 ? v->n_records : 1));
+				v->row = malloc(sizeof(unsigned int) * (v->n_records > 0 ? v->n_records : 1));
+				v->row_start = malloc(sizeof(size_t) * (v->n_routers + 1));
+				v->row_count = calloc((size_t) v->n_parts * (v->n_routers > 0 ? v->n_routers : 1), sizeof(unsigned int));
+				v->chunks = malloc(sizeof(struct validate_chunk) * n_outputs);
+				if (!(v->from_slot) || !(v->row) || !(v->row_start) || !(v->row_count) || !(v->chunks)) {
+						perror("Error with malloc");
+						result = FAILURE;
+				}
+		}
+		if (result == SUCCESS) {
+
+				/* Check each record, then count and check the connections of each router */
+				v->pass = 1;
+				atomic_store(&v->next_chunk, 0);
+				validate_run(validate_records);
+
+				/* The last record may lack its 0-byte, anything shorter is cut short */
+				if (rest % CONNECTION_RECORD_SIZE != 0 && rest % CONNECTION_RECORD_SIZE != CONNECTION_RECORD_SIZE - 1) {
+						printf("byte %zu: connection record cut short after %zu bytes by the end of the file\n",
+							pos + v->n_records * CONNECTION_RECORD_SIZE, rest % CONNECTION_RECORD_SIZE);
+						v->n_problems++;
+				}
+				v->pass = 2;
+				validate_run(validate_rows);
+
+				/* Turn the counts of each part into where its records go in row */
+				size_t start = 0;
+				for (int i = 0; i < v->n_routers; i++) {
+						v->row_start[i] = start;
+						for (int p = 0; p < v->n_parts; p++) {
+								unsigned int *count = &v->row_count[(size_t) p * v->n_routers + i];
+								unsigned int n = *count;
+								*count = start;
+								start += n;
+						}
 				}
+				v->row_start[v->n_routers] = start;
+				v->pass = 3;
+				validate_run(validate_rows);
+				v->pass = 4;
+				validate_run(validate_rows);
+		}
 
-				/* Check for error during command execution. */
-				/* If so, do cleanup and return result (FAILURE or CRITICAL_FAILURE) */
-				result = run_command(line);
-				if (result == CRITICAL_FAILURE) {
-						free(line);
-						return result;
+		printf("\n%s: %d routers", filename, v->n_declared);
+		if (v->n_duplicates > 0)
+				printf(" (%d with a duplicate ID)", v->n_duplicates);
+		printf(", %zu connection records, %ld problems\n", v->n_records, (long) v->n_problems);
+		if (result == SUCCESS && v->n_problems > 0)
+				result = FAILURE;
+		munmap((void *) v->buf, v->size);
+		free(v->block);
+		free(v->from_slot);
+		free(v->row);
+		free(v->row_start);
+		free(v->row_count);
+		free(v->chunks);
+		index_free();
+		return result;
+}
+
+
+/*
+ * Checks the header and information blocks of the file mapped in
+ * <struct validation *v>, and indexes the ID of each router. Sets
+ * <size_t *pos> to the start of the connection section.
+ * Returns FAILURE if the connection section could not be found (a block
+ * runs past the end of the file) or memory ran out, SUCCESS otherwise.
+ */
+int validate_routers(struct validation *v, size_t *pos)
+{
+		int num_routers;
+		memcpy(&num_routers, v->buf, sizeof(int));
+		v->n_declared = num_routers;
+		if (num_routers < 0) {
+				printf("byte 0: number of routers %d is negative\n", num_routers);
+				v->n_problems++;
+				num_routers = 0;
+		}
+		size_t room = (v->size - sizeof(int)) / (HEADER_SIZE + 1);
+		if ((size_t) num_routers > room) {
+				printf("byte 0: %d routers do not fit in a file of %zu bytes\n", num_routers, v->size);
+				v->n_problems++;
+				num_routers = room;
+		}
+		v->block = malloc(sizeof(size_t) * (num_routers > 0 ? num_routers : 1));
+		if (!(v->block) || index_init(num_routers) != SUCCESS) {
+				if (!(v->block))
+						perror("Error with malloc");
+				return FAILURE;
+		}
+
+		*pos = sizeof(int);
+		for (int i = 0; i < num_routers; i++) {
+				const unsigned char *b = v->buf + *pos;
+				if (v->size - *pos < HEADER_SIZE || v->size - *pos - HEADER_SIZE < b[5]) {
+						printf("byte %zu: router information block ends past end of file\n", *pos);
+						v->n_problems++;
+						return FAILURE;
+				}
+				size_t desc_end = *pos + HEADER_SIZE + b[5];
+				const unsigned char *end = memchr(v->buf + desc_end, 0, v->size - desc_end);
+				if (!(end)) {
+						printf("byte %zu: router information block has no terminating 0\n", *pos);
+						v->n_problems++;
+						return FAILURE;
 				}
 
-				/* Since the last call might include and ending newline and
-				 * not an EOF, check if next call to fgetc() results in EOF.
-				 * If not eof, unget character for later processing */
-				tmp = fgetc(fh);
-				if (!(feof(fh))) {
-						ungetc(tmp, fh);
+				unsigned int routerID;
+				memcpy(&routerID, b, sizeof(unsigned int));
+				size_t block_len = end - b + 1;
+				if (block_len > BLOCK_MAX_SIZE) {
+						printf("byte %zu: router %u has an information block of %zu bytes, more than %d\n", *pos, routerID, block_len, BLOCK_MAX_SIZE);
+						v->n_problems++;
+				}
+				if (b[5] > DESC_MAX_LEN) {
+						printf("byte %zu: router %u has desc_len %u, more than %d\n", *pos + 5, routerID, b[5], DESC_MAX_LEN);
+						v->n_problems++;
+				}
+				int slot = index_lookup(routerID);
+				if (slot != INDEX_EMPTY) {
+						printf("byte %zu: router %u is already defined at byte %zu\n", *pos, routerID, v->block[slot]);
+						v->n_problems++;
+						v->n_duplicates++;
+				} else {
+						v->block[v->n_routers] = *pos;
+						index_insert(routerID, v->n_routers++);
 				}
+				*pos += block_len;
 		}
-		free(line);
 		return SUCCESS;
 }
 
 
+/*
+ * Runs the current pass of the validation with <task>, in the worker pool
+ * if the file is large enough. The reports of the workers are then printed
+ * in file order: by chunk in pass 1, and by worker (whose slot ranges are in
+ * order) in the later passes.
+ */
+void validate_run(void (*task)(struct worker *w))
+{
+		struct validation *v = &validation;
+		if (!(v->parallel)) {
+				task(NULL);
+				return;
+		}
+		int n_outputs = v->pass == 1 ? v->n_chunks : worker_pool.n_threads;
+		pool_run(task);
+		for (int w = 0; w < worker_pool.n_threads; w++)
+				fflush(worker_pool.workers[w].out);
+		for (int c = 0; c < n_outputs; c++) {
+				struct validate_chunk *chunk = &v->chunks[c];
+				fwrite(worker_pool.workers[chunk->worker].out_buf + chunk->out_start, 1, chunk->out_len, stdout);
+		}
+		for (int w = 0; w < worker_pool.n_threads; w++)
+				rewind(worker_pool.workers[w].out);
+}
+
 
-/* --- PATH SEARCH FUNCTIONS --- */
 /*
- * Searches through an array of pointers to struct, and finds the index
- * for the router with <unsigned int routerID>.
- * Assumes that each router in global router_array has a pointer to
- * pointing to it in ptr_array.
- */
-int get_idx_in_visited(unsigned int routerID, struct router *ptr_array[])
-{
-		for(int i = 0; i < N_ROUTERS; i++)
-				if (ptr_array[i]->routerID == routerID)
-						return i;
-		return FAILURE;
-}
-
-/*
- * Recursive function for finding a path between two nodes.
- * r_ptr is the from-router, findID is the ID of to-router.
- * visited[] is an array containing info on which nodes has already been visited,
- * and ptr_array is an array of pointers to structs. The index of a router in the ptr_array
- * corresponds to the index in visited[].
- * path is an array containing IDs of the routers visited (and can thus be used to print path if found).
- * path_size keeps track of the current allocated size of path (for it to to be readjusted with realloc upon need),
- * and path_cur_ptr is a pointer to a pointer, which points to next free idx in ptr_array to place IDs.
- * (It's a double pointer so that the original in pointer in the calling function 'exists_path' also is modified).
- */
-int recursive_search(struct router *r_ptr,
-					 unsigned int findID,
-					 int *visited[],
-					 struct router *ptr_array[],
-					 unsigned int *path[],
-					 int *path_size,
-					 unsigned int **path_cur_ptr)
-{
-		/* Check if path is full, if so realloc */
-		ptrdiff_t cur_size = (*path_cur_ptr) - *path;
-		if (cur_size >= (*path_size) - 1) {
-				/* puts("Doing a realloc!");                       /\* DEBUG *\/ */
-				/* printf("Current path_size: %d\n", *path_size); /\* DEBUG *\/ */
-				*path = realloc(*path, sizeof(unsigned int) * (*path_size) * 2);
-				*path_cur_ptr = *path + cur_size;
-				*path_size = *path_size * 2;
-				if (!*path) {
-						fprintf(stderr, "%sError%s: realloc in recursive search failed.", CLR_RED, CLR_NRM);
-						fprintf(stderr, " Will likely result in SEGFAULT\n");
-				}
-		}
-
-		/* In visited-array, set current node (r_ptr) as visited */
-		int visited_idx = get_idx_in_visited(r_ptr->routerID, ptr_array);
-		(*visited)[visited_idx] = TRUE;
-
-		**path_cur_ptr = r_ptr->routerID;
-		(*path_cur_ptr)++;
-
-		/* printf("\nVisiting router %u\n", r_ptr->routerID);  /\* DEBUG *\/ */
-		/* print_visited_array(*visited, ptr_array);           /\* DEBUG *\/ */
-		/* print_path(*path, (*path_cur_ptr) - 1);             /\* DEBUG *\/ */
-
-		if (is_connected(r_ptr, findID)) {
-				/* Connection found */
-				/* printf("\nIn IF: DIFF: %ld\n", *path_cur_ptr - *path);  /\* DEBUG *\/ */
-				**path_cur_ptr = findID;
-				return TRUE;
+ * Pass 1 of the validation: takes chunks of connection records until there
+ * are none left, checks that both routers exist and that the record ends
+ * with a 0-byte, and notes the slot of the from-router. Problems are
+ * reported to the output of <struct worker *w>, or stdout if w is NULL.
+ */
+void validate_records(struct worker *w)
+{
+		struct validation *v = &validation;
+		FILE *out = w ? w->out : stdout;
+		int c;
+		while ((c = atomic_fetch_add(&v->next_chunk, 1)) < v->n_chunks) {
+				long out_start = w ? ftell(out) : 0;
+				long problems = 0;
+				size_t first = (size_t) c * LOAD_CHUNK_RECORDS;
+				size_t end = first + LOAD_CHUNK_RECORDS < v->n_records ? first + LOAD_CHUNK_RECORDS : v->n_records;
+				for (size_t i = first; i < end; i++) {
+						size_t offset = v->records_start + i * CONNECTION_RECORD_SIZE;
+						const unsigned char *record = v->buf + offset;
+						unsigned int fromID, toID;
+						memcpy(&fromID, record, sizeof(unsigned int));
+						memcpy(&toID, record + sizeof(unsigned int), sizeof(unsigned int));
+						v->from_slot[i] = index_lookup(fromID);
+						if (v->from_slot[i] == INDEX_EMPTY) {
+								fprintf(out, "byte %zu: connection from unknown router %u\n", offset, fromID);
+								problems++;
+						}
+						if (index_lookup(toID) == INDEX_EMPTY) {
+								fprintf(out, "byte %zu: connection to unknown router %u\n", offset + sizeof(unsigned int), toID);
+								problems++;
+						}
+						if (offset + 2 * sizeof(unsigned int) < v->size && record[2 * sizeof(unsigned int)] != 0) {
+								fprintf(out, "byte %zu: connection record ends with %u instead of a 0-byte\n",
+									offset + 2 * sizeof(unsigned int), record[2 * sizeof(unsigned int)]);
+								problems++;
+						}
+				}
+				atomic_fetch_add(&v->n_problems, problems);
+				if (w) {
+						v->chunks[c].worker = w->id;
+						v->chunks[c].out_start = out_start;
+						v->chunks[c].out_len = ftell(out) - out_start;
+				}
+		}
+}
+
+
+/*
+ * Passes 2 to 4 of the validation, for the part of the records (passes 2
+ * and 3) or the routers in the slots (pass 4) owned by <struct worker *w>,
+ * or all of them if w is NULL. Pass 2 counts the connection records of
+ * each router in the part. Pass 3, with the counts turned into positions,
+ * lists the part's records in row. Pass 4 reports routers with more than
+ * SPEC_MAX_CONNECTIONS connections and connections given more than once.
+ */
+void validate_rows(struct worker *w)
+{
+		struct validation *v = &validation;
+		FILE *out = w ? w->out : stdout;
+		long out_start = w ? ftell(out) : 0;
+		int part = w ? w->id : 0;
+		size_t first = v->n_records * part / v->n_parts;
+		size_t end = v->n_records * (part + 1) / v->n_parts;
+		unsigned int *count = v->row_count + (size_t) part * v->n_routers;
+		int lo = (int) ((long) v->n_routers * part / v->n_parts);
+		int hi = (int) ((long) v->n_routers * (part + 1) / v->n_parts);
+
+		if (v->pass == 2) {
+				for (size_t i = first; i < end; i++)
+						if (v->from_slot[i] != INDEX_EMPTY)
+								count[v->from_slot[i]]++;
+		} else if (v->pass == 3) {
+				for (size_t i = first; i < end; i++)
+						if (v->from_slot[i] != INDEX_EMPTY)
+								v->row[count[v->from_slot[i]]++] = i;
 		} else {
-				/* Recursive search through all connections of current pointer */
-				struct router *next_router;
-				int next_visited_idx;
-				for (int i = 0; i < MAX_CONNECTIONS; i++) {
-						next_router = r_ptr->connections[i];
-						/* If not NULL, and next router not already visited */
-						if (next_router) {
-								next_visited_idx = get_idx_in_visited(next_router->routerID, ptr_array);
-								if (!(*visited)[next_visited_idx]) {
-										/* Recursive call */
-										if(recursive_search(next_router, findID, visited, ptr_array, path, path_size, path_cur_ptr)) {
-												return TRUE;
-										}
+				long problems = 0;
+				for (int slot = lo; slot < hi; slot++) {
+						unsigned int *row = v->row + v->row_start[slot];
+						size_t n = v->row_start[slot + 1] - v->row_start[slot];
+						unsigned int routerID;
+						memcpy(&routerID, v->buf + v->block[slot], sizeof(unsigned int));
+						if (n > SPEC_MAX_CONNECTIONS) {
+								fprintf(out, "byte %zu: router %u has %zu connections, more than %d\n", v->block[slot], routerID, n, SPEC_MAX_CONNECTIONS);
+								problems++;
+						}
+						if (n < 2)
+								continue;
+
+						/* Sorted by toID, a repeated connection follows the first one */
+						qsort(row, n, sizeof(unsigned int), validate_compare_records);
+						size_t first = v->records_start + (size_t) row[0] * CONNECTION_RECORD_SIZE;
+						unsigned int first_to, toID;
+						memcpy(&first_to, v->buf + first + sizeof(unsigned int), sizeof(unsigned int));
+						for (size_t k = 1; k < n; k++) {
+								size_t offset = v->records_start + (size_t) row[k] * CONNECTION_RECORD_SIZE;
+								memcpy(&toID, v->buf + offset + sizeof(unsigned int), sizeof(unsigned int));
+								if (toID == first_to) {
+										fprintf(out, "byte %zu: connection from %u to %u repeats the one at byte %zu\n", offset, routerID, toID, first);
+										problems++;
+								} else {
+										first = offset;
+										first_to = toID;
 								}
 						}
 				}
+				atomic_fetch_add(&v->n_problems, problems);
 		}
-		/* When unnesting, mark this router as not visited, */
-		/* and decrement current position of pointer to path-array */
-		(*path_cur_ptr)--;
-		(*visited)[visited_idx] = FALSE;
-		return FALSE;
+
+		if (w) {
+				v->chunks[w->id].worker = w->id;
+				v->chunks[w->id].out_start = out_start;
+				v->chunks[w->id].out_len = ftell(out) - out_start;
+		}
+}
+
+
+/* Orders connection record numbers by toID, then by position in the file, for qsort() */
+int validate_compare_records(const void *a, const void *b)
+{
+		unsigned int i = *(const unsigned int *) a;
+		unsigned int j = *(const unsigned int *) b;
+		unsigned int to_i, to_j;
+		memcpy(&to_i, validation.buf + validation.records_start + (size_t) i * CONNECTION_RECORD_SIZE + sizeof(unsigned int), sizeof(unsigned int));
+		memcpy(&to_j, validation.buf + validation.records_start + (size_t) j * CONNECTION_RECORD_SIZE + sizeof(unsigned int), sizeof(unsigned int));
+		if (to_i != to_j)
+				return to_i < to_j ? -1 : 1;
+		return i < j ? -1 : i > j;
+}
+
+
+
+/* --- OUTPUT FUNCTIONS --- */
+
+/* Starts empty <struct out_chunk *c> writing to <FILE *out> */
+void chunk_start(struct out_chunk *c, FILE *out)
+{
+		c->out = out;
+		c->len = 0;
+}
+
+
+/* Writes the formatted bytes of <struct out_chunk *c> to its file */
+void chunk_flush(struct out_chunk *c)
+{
+		if (c->len > 0)
+				fwrite(c->data, 1, c->len, c->out);
+		c->len = 0;
 }
 
 
 /*
- * Makes a call to the recursive search-function  to find a path from
- * router given by <unsigned int fromID> to router given by <unsigned int toID>.
- * Returns TRUE if a path is found, and FALSE otherwise.
+ * Returns room for <size_t n> more bytes in <struct out_chunk *c>,
+ * flushing it first if needed. n is at most OUTPUT_CHUNK_SIZE.
+ * The caller adds n to c->len once the bytes are written.
  */
-int exists_path(unsigned int fromID, unsigned int toID)
+char *chunk_reserve(struct out_chunk *c, size_t n)
 {
-		/* Initialize temporary arrays and pointers for search. */
-		/* Allocated memory is freed at end of this function */
-		int *visited = malloc(sizeof(int) * N_ROUTERS);  /* Allocated: 4 bytes * N_ROUTERS: 40 bytes if 10 routers.  */
-		struct router **ptr_array = malloc(sizeof(struct router*) * N_ROUTERS);  /* Allocated: 80 bytes if 10 routers */
-		memset(visited, FALSE, sizeof(int) * N_ROUTERS);
+		if (c->len + n > OUTPUT_CHUNK_SIZE)
+				chunk_flush(c);
+		return c->data + c->len;
+}
 
-		int path_size = 16;  /* Will not work if < 2 */
-		/* Allocated for path: Initially path_size * 4 bytes.
-		 * During runtime array can be expanded with realloc in recursive search.
-		 * Memory is not freed until end of this function.
-		 */
-		unsigned int *path = malloc(sizeof(unsigned int) * path_size);
-		unsigned int *path_cur_ptr = path;
 
-		/*
-		 * Assign each pointer in global array to this array
-		 * This is done because global array has size N (might contain NULL-pointers),
-		 * but local array, ptr_array, must contain only valid router pointers.
-		 */
-		int idx = 0;
-		for (int i = 0; i < N; i++) {
-				if (router_array[i]) {
-						ptr_array[idx++] = router_array[i];
+/* Appends <size_t n> bytes from <const void *src> to <struct out_chunk *c> */
+void chunk_bytes(struct out_chunk *c, const void *src, size_t n)
+{
+		if (n > OUTPUT_CHUNK_SIZE) {
+				chunk_flush(c);
+				fwrite(src, 1, n, c->out);
+				return;
+		}
+		memcpy(chunk_reserve(c, n), src, n);
+		c->len += n;
+}
+
+
+void chunk_string(struct out_chunk *c, const char *s)
+{
+		chunk_bytes(c, s, strlen(s));
+}
+
+
+/* Appends <unsigned int value> in decimal, like printf("%u") */
+void chunk_uint(struct out_chunk *c, unsigned int value)
+{
+		char digits[10];
+		int n = 0;
+		do {
+				digits[n++] = '0' + value % 10;
+				value /= 10;
+		} while (value);
+
+		char *dest = chunk_reserve(c, n);
+		for (int i = 0; i < n; i++)
+				dest[i] = digits[n - 1 - i];
+		c->len += n;
+}
+
+
+/* Appends <int value> right aligned in <int width> columns, like printf("%*d") */
+void chunk_int(struct out_chunk *c, int value, int width)
+{
+		unsigned int magnitude = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+		int n = value < 0 ? 2 : 1;
+		for (unsigned int rest = magnitude / 10; rest; rest /= 10)
+				n++;
+
+		char *dest = chunk_reserve(c, width > n ? width : n);
+		for (; width > n; width--) {
+				*dest++ = ' ';
+				c->len++;
+		}
+		if (value < 0) {
+				*dest = '-';
+				c->len++;
+		}
+		chunk_uint(c, magnitude);
+}
+
+
+/* Appends <unsigned int value> in lower case hex, at least <int width> digits, like printf("%0*x") */
+void chunk_hex(struct out_chunk *c, unsigned int value, int width)
+{
+		char digits[8];
+		int n = 0;
+		do {
+				digits[n++] = "0123456789abcdef"[value & 0xf];
+				value >>= 4;
+		} while (value);
+		while (n < width && n < 8)
+				digits[n++] = '0';
+
+		char *dest = chunk_reserve(c, n);
+		for (int i = 0; i < n; i++)
+				dest[i] = digits[n - 1 - i];
+		c->len += n;
+}
+
+
+/*
+ * Appends the <int len> bytes of <const char *s> as a quoted JSON string.
+ * Quotes, backslashes and control characters are escaped, and so is every
+ * byte from 0x80 up, as \u00XX, since descriptions need not be valid UTF-8.
+ */
+void chunk_json_string(struct out_chunk *c, const char *s, int len)
+{
+		chunk_bytes(c, "\"", 1);
+		int start = 0;
+		for (int i = 0; i < len; i++) {
+				unsigned char ch = s[i];
+				if (ch >= 0x20 && ch < 0x80 && ch != '"' && ch != '\\')
+						continue;
+				chunk_bytes(c, s + start, i - start);
+				char *dest = chunk_reserve(c, 6);
+				if (ch == '"' || ch == '\\') {
+						dest[0] = '\\';
+						dest[1] = ch;
+						c->len += 2;
+				} else {
+						memcpy(dest, "\\u00", 4);
+						dest[4] = "0123456789abcdef"[ch >> 4];
+						dest[5] = "0123456789abcdef"[ch & 0xf];
+						c->len += 6;
 				}
+				start = i + 1;
 		}
+		chunk_bytes(c, s + start, len - start);
+		chunk_bytes(c, "\"", 1);
+}
 
-		puts("\n- Path search -");
-		if (recursive_search(get_router(fromID), toID, &visited, ptr_array, &path, &path_size, &path_cur_ptr)) {
-				printf("%sFound a path%s from router %u to %u!\n", CLR_GREEN, CLR_NRM, fromID, toID);
-				print_path(path, path_cur_ptr);
-		} else {
-				printf("%sCould not find a path%s from router %u to %u.\n", CLR_YELLOW, CLR_NRM, fromID, toID);
+
+/*
+ * Formats the data printed by print_router_data() of the router in
+ * <int slot> of graph <struct snapshot *g> into <struct out_chunk *c>
+ */
+void chunk_router_data(struct out_chunk *c, struct snapshot *g, int slot)
+{
+		struct router_view r;
+		graph_router(g, slot, &r);
+		const struct router_desc *d = r.desc;
+		chunk_string(c, "id:           ");
+		chunk_int(c, r.routerID, 3);
+		chunk_string(c, "    0x");
+		chunk_hex(c, r.routerID, 2);
+		chunk_string(c, "\nflag:                0x");
+		chunk_hex(c, r.flag, 2);
+		chunk_string(c, "\ndesc_len:     ");
+		chunk_int(c, d->desc_len, 3);
+		chunk_string(c, "    0x");
+		chunk_hex(c, d->desc_len, 2);
+		chunk_string(c, "\nProd./model:   ");
+		chunk_bytes(c, d->description, d->desc_len);
+
+		/* Print out all connections */
+		chunk_string(c, "\nConnected to:  ");
+		for (int i = 0; i < r.n_conn; i++) {
+				chunk_int(c, graph_router_id(g, r.conn[i]), 0);
+				chunk_bytes(c, " ", 1);
 		}
+		chunk_bytes(c, "\n", 1);
+}
 
-		/* Frees temporary arrays allocated at beginning of this function */
-		free(path);
-		free(visited);
-		free(ptr_array);
-		return SUCCESS;
+
+/*
+ * Prints the answer to 'print' of the router in <int slot> of graph
+ * <struct snapshot *g> (the live graph if NULL) to <FILE *out>: a heading
+ * and the data of the router, or one JSON object in JSON mode.
+ */
+void print_router_info(FILE *out, struct snapshot *g, int slot)
+{
+		struct router_view r;
+		graph_router(g, slot, &r);
+		struct out_chunk c;
+		chunk_start(&c, out);
+		if (output_mode == OUTPUT_TEXT) {
+				chunk_string(&c, "\nInformation – Router ");
+				chunk_int(&c, r.routerID, 0);
+				chunk_string(&c, ":\n");
+				chunk_router_data(&c, g, slot);
+				chunk_flush(&c);
+				return;
+		}
+
+		const struct router_desc *d = r.desc;
+		chunk_string(&c, "{\"command\":\"print\",\"id\":");
+		chunk_uint(&c, r.routerID);
+		chunk_string(&c, ",\"flag\":");
+		chunk_uint(&c, r.flag);
+		chunk_string(&c, ",\"desc_len\":");
+		chunk_uint(&c, d->desc_len);
+		chunk_string(&c, ",\"model\":");
+		chunk_json_string(&c, d->description, d->desc_len);
+		chunk_string(&c, ",\"connections\":[");
+		for (int i = 0; i < r.n_conn; i++) {
+				if (i > 0)
+						chunk_bytes(&c, ",", 1);
+				chunk_uint(&c, graph_router_id(g, r.conn[i]));
+		}
+		chunk_string(&c, "]}\n");
+		chunk_flush(&c);
 }
 
 
-void print_path(unsigned int path[], unsigned int *path_cur_ptr)
+/*
+ * Reports that read-only command <enum command_kind kind> named nonexistent
+ * router <unsigned int routerID>: a warning on stderr, or in JSON mode an
+ * object with an error to <FILE *out>, so every command has its object.
+ */
+void print_unknown_router(FILE *out, enum command_kind kind, unsigned int routerID)
 {
-		printf("Path: ");
-		for (int i = 0; i < (path_cur_ptr - path); i++)
-				printf("%u ", path[i]);
-		puts("");
+		if (output_mode == OUTPUT_TEXT) {
+				print_invalid_routerID(routerID);
+				return;
+		}
+		fprintf(out, "{\"command\":\"%s\",\"id\":%u,\"error\":\"nonexistent router\"}\n",
+			kind == CMD_PRINT ? "print" : "finnes_rute", routerID);
 }
 
 
@@ -1002,37 +6879,42 @@ int error_flag_file(FILE *fh, char calling_function[])
 /*
  * Cleanup function which closes open files and frees allocated memory.
  * Is called only if set_connections or run_all_commands return a CRITICAL_FAILURE.
+ * Records of the journal not yet written are dropped.
  */
 void cleanup_on_abort(FILE *router_file, FILE *commands_file)
 {
 		fclose(router_file);
-		fclose(commands_file);
+		if (commands_file)
+				fclose(commands_file);
 		remove_all_routers();
 		free(router_array);    /* Global array */
+		free(desc_store);
+		adjacency_free();
+		index_free();
+		scratch_free(&search_scratch);
+		reach_cache_free();
+		scc_free();
+		read_run_free();
+		pool_free();
+		if (stats.enabled)
+				stats_write();
+		if (journal.buf.data)
+				close(journal.buf.fd);
+		journal_free();
 }
 
 
 /*
- * Print all data in struct of router given as argument <struct router *r>.
- * Also prints which (one way) connections router has to other routers.
+ * Print all data in struct of router given as argument <struct router *r>
+ * to <FILE *out>. Also prints which (one way) connections router has to
+ * other routers.
 */
-void print_router_data(struct router *r)
+void print_router_data(FILE *out, struct router *r)
 {
-		/* Print info on given router */
-		printf("id:           %3d    0x%02x\n", r->routerID, r->routerID);
-		printf("flag:                0x%02x\n", r->flag);
-		printf("desc_len:     %3d    0x%02x\n", r->desc_len, r->desc_len);
-		printf("Prod./model:   ");
-		for(int i = 0; i < r->desc_len; i++)
-				printf("%c", r->description[i]);
-
-		/* Print out all connections */
-		printf("\nConnected to:  ");
-		for(int i = 0; i < MAX_CONNECTIONS; i++) {
-				if (r->connections[i] != NULL)
-						printf("%d ", r->connections[i]->routerID);
-		}
-		puts("");
+		struct out_chunk c;
+		chunk_start(&c, out);
+		chunk_router_data(&c, NULL, r->slot);
+		chunk_flush(&c);
 }
 
 
@@ -1061,6 +6943,15 @@ void print_invalid_routerID(unsigned int(routerID))
 }
 
 
+/*
+ * Function used in execute_command() to print error messages.
+ */
+void print_missing_arguments(struct command *cmd)
+{
+		fprintf(stderr, "%sWarning%s: too few arguments to '%.*s'. Ignoring.\n", CLR_RED, CLR_NRM, cmd->keyword_len, cmd->keyword);
+}
+
+
 
 /* --- HELPER FUNCTIONS --- */
 /* Not necessary for functionality */
@@ -1073,7 +6964,7 @@ void print_all_router_data(struct router **array, int N)
 				r = array[i];
 				if (r) {
 						printf("\n--- Router id nr. %d ---\n", r->routerID);
-						print_router_data(r);
+						print_router_data(stdout, r);
 				}
 		}
 }
@@ -1082,36 +6973,13 @@ void print_all_router_data(struct router **array, int N)
 void print_sizeof_router()
 {
 		struct router r;
+		struct router_desc d;
 		printf("sizeof struct router: %ld\n", sizeof(r));
 		printf("size of r.routerID: %ld\n", sizeof(r.routerID));
 		printf("size of r.flag: %ld\n", sizeof(r.flag));
-		printf("size of r.desc_len: %ld\n", sizeof(r.desc_len));
-		printf("size of r.description: %ld\n", sizeof(r.description));
-		printf("size of r.connections: %ld\n", sizeof(r.connections));
-}
-
-
-void print_visited_array(int visited[], struct router **ptr_array)
-{
-		printf("\nVisited[]:      ");
-		for (int i = 0; i < N_ROUTERS; i++){
-				printf("%2d ", visited[i]);
-		}
-		printf("\nID of routers:  ");
-		for (int i = 0; i < N_ROUTERS; i++) {
-				printf("%2d ", ptr_array[i]->routerID);
-		}
-		printf("\nidx in visited: ");
-		/* Handles cases where ptrs are moved. Keeps printing sorted. */
-		int cur_idx;
-		for (int i = 0; i < N_ROUTERS; i++) {
-				for (int j = 0; j < N_ROUTERS; j++) {
-						cur_idx = get_idx_in_visited(ptr_array[i]->routerID, ptr_array);
-						if (cur_idx == i) {
-								printf("%2d ", cur_idx);
-								break;
-						}
-				}
-		}
-		puts("");
+		printf("size of r.conn_start: %ld\n", sizeof(r.conn_start));
+		printf("size of r.n_conn: %ld\n", sizeof(r.n_conn));
+		printf("sizeof struct router_desc: %ld\n", sizeof(d));
+		printf("size of d.desc_len: %ld\n", sizeof(d.desc_len));
+		printf("size of d.description: %ld\n", sizeof(d.description));
 }